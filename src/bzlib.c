@@ -1,68 +1,125 @@
 #include "config.h"
 #if HAVE_BZLIB
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <bzlib.h>
 #include "ncd.h"
 
 #define BZ_FILE_CHUNK 102400
 
+/** Minimum number of chunks compressed by each thread on parallel mode */
+#define BZ_PART_CHUNKS 4
+/** Maximum number of threads compressing the same stream */
+#define BZ_MAX_PARTS 64
+
+/** Length of the tail of the compressed stream kept to find its bit length */
+#define BZ_TAIL_LEN 16
+/** Stream header ("BZh" + block size) plus trailer (magic + CRC), in bits */
+#define BZ_STREAM_OVERHEAD (32 + 48 + 32)
+
+/** Compressed blocks of file A (see bzlib_prefix_open()) */
+typedef struct _bzlib_prefix {
+	/** Bytes of A covered by whole blocks (multiple of BZ_FILE_CHUNK) */
+	size_t boundary;
+	/** Compressed size (in bits) of all blocks before boundary */
+	ssize_t bits;
+} bzlib_prefix_t;
+
+/** Part of the input compressed by a thread (see bzlib_bits()) */
+typedef struct _bzlib_part {
+	/** Input file (own position) */
+	ncd_file_t fin;
+	/** Number of bytes to compress */
+	size_t len;
+	/** Compressed size (in bits) of the blocks */
+	ssize_t bits;
+	/** Job run by a borrowed thread */
+	sched_job_t job;
+} bzlib_part_t;
+
+
 /**
- * \brief Return compressed file size using bzlib
+ * \brief Compress len bytes of the file (from current position) into a bzip2 stream
  *
- * \return ssize_t Compressed size
+ * \param fin Input file
+ * \param len Number of bytes to compress
+ * \param tail Buffer (BZ_TAIL_LEN bytes) to receive the end of the
+ *        compressed stream (it can be NULL)
+ * \return ssize_t Compressed size, -1 on error
+ * \note Each BZ_FILE_CHUNK of input is flushed, so it always ends a block.
+ *       Since bzip2 blocks are independent, the compressed bits of a chunk do
+ *       not depend on the data that come before or after it.
  */
-ssize_t bzlib_getcompsize(ncd_file_t *fin)
+static ssize_t bzlib_compress(ncd_file_t *fin, size_t len, unsigned char *tail)
 {
 	int ret, flush;
-	char dIn[BZ_FILE_CHUNK];
+	const unsigned char *dIn;
 	char dOut[BZ_FILE_CHUNK];
-	unsigned int have;
-	ssize_t cSize;
+	unsigned int have, keep;
+	size_t cnt;
+	ssize_t cSize, rd;
 	bz_stream strm;
 
 	/* Allocate inflate state */
 	cSize = 0;
+	strm.bzalloc = NULL;
+	strm.bzfree  = NULL;
+	strm.opaque  = NULL;
 	ret   = BZ2_bzCompressInit(&strm, 1, 0, 0);
 	if(ret != BZ_OK) {
-		ncd_err = -1;
-		return 0;
+		return -1;
 	}
 
 	do {
-		strm.avail_in = ncd_fread(dIn, 1, BZ_FILE_CHUNK, fin);
- 		if (ncd_ferror(fin)) {
-			(void)BZ2_bzCompressEnd(&strm);
-			return 0;
-		}
-		flush = ncd_feof(fin) ? BZ_FINISH : BZ_FLUSH;
-		strm.next_in = dIn;
-
+		/* A chunk may span both files (segments) */
+		cnt = (len < BZ_FILE_CHUNK ? len : BZ_FILE_CHUNK);
 		do {
-			strm.avail_out = BZ_FILE_CHUNK;
-			strm.next_out  = dOut;
-			ret = BZ2_bzCompress(&strm, flush);
-			/* assert state */
-			if(ret == BZ_SEQUENCE_ERROR) {
-				ncd_err = -1;
-				return 0;
+			rd = ncd_fsegment(fin, &dIn, cnt);
+			if (ncd_ferror(fin) || rd < 0) {
+				(void)BZ2_bzCompressEnd(&strm);
+				return -1;
 			}
+			cnt -= rd;
+			len -= rd;
+			if (cnt == 0 || ncd_feof(fin)) {
+				flush = (len == 0 || ncd_feof(fin)) ? BZ_FINISH : BZ_FLUSH;
+			} else {
+				flush = BZ_RUN;
+			}
+			strm.avail_in = rd;
+			strm.next_in  = (char*)dIn;
 
-			have   = BZ_FILE_CHUNK - strm.avail_out;
-			cSize += have;
-		} while (strm.avail_out == 0);
-		if(strm.avail_in != 0) {
-			ncd_err = - 1;
-			return 0;
-		}
+			do {
+				strm.avail_out = BZ_FILE_CHUNK;
+				strm.next_out  = dOut;
+				ret = BZ2_bzCompress(&strm, flush);
+				/* assert state */
+				if(ret == BZ_SEQUENCE_ERROR) {
+					(void)BZ2_bzCompressEnd(&strm);
+					return -1;
+				}
+
+				have   = BZ_FILE_CHUNK - strm.avail_out;
+				cSize += have;
+
+				/* Keep the last bytes of the stream */
+				if (tail != NULL && have > 0) {
+					keep = (have < BZ_TAIL_LEN ? have : BZ_TAIL_LEN);
+					memmove(tail, &tail[keep], BZ_TAIL_LEN - keep);
+					memcpy(&tail[BZ_TAIL_LEN - keep], &dOut[have - keep], keep);
+				}
+			} while (strm.avail_out == 0);
+			if(strm.avail_in != 0) {
+				(void)BZ2_bzCompressEnd(&strm);
+				return -1;
+			}
+		} while (flush == BZ_RUN);
 
 	} while(flush != BZ_FINISH);
-	if(ret != BZ_STREAM_END) {
-		ncd_err = -1;
-		return 0;
-	}
 
 	/* Clean up */
-    (void)BZ2_bzCompressEnd(&strm);
+	(void)BZ2_bzCompressEnd(&strm);
 
 	/* Return */
 	if (ret != BZ_STREAM_END) {
@@ -71,5 +128,241 @@ ssize_t bzlib_getcompsize(ncd_file_t *fin)
 		return cSize;
 	}
 }
+
+
+/**
+ * \brief Return the size (in bits) of all compressed blocks of a bzip2 stream
+ *
+ * The stream is padded with zeros up to a byte boundary after the end of
+ * stream magic (0x177245385090) and the combined CRC, so the exact bit
+ * length is found by looking for the magic at the end of the stream.
+ *
+ * \param cSize Compressed stream size (in bytes)
+ * \param tail Last BZ_TAIL_LEN bytes of the stream
+ * \return ssize_t Size of the compressed blocks (in bits), -1 on error
+ */
+static ssize_t bzlib_blockbits(ssize_t cSize, const unsigned char *tail)
+{
+	const unsigned long long eos = 0x177245385090ULL;
+	unsigned long long magic, pad;
+	int p, b, bit, base;
+
+	if (cSize < (BZ_STREAM_OVERHEAD / 8)) {
+		return -1;
+	}
+
+	/* Bit position of the first bit in tail buffer */
+	base = BZ_TAIL_LEN * 8;
+	for (p = 0; p < 8; p++) {
+		magic = 0;
+		pad   = 0;
+		for (b = base - p - 80; b < base; b++) {
+			bit = (tail[b / 8] >> (7 - (b % 8))) & 1;
+			if (b < (base - p - 32)) {
+				magic = (magic << 1) | bit;
+			} else if (b >= (base - p)) {
+				pad |= bit;
+			}
+		}
+		if (magic == eos && pad == 0) {
+			return (cSize * 8 - p - BZ_STREAM_OVERHEAD);
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * \brief Compress a part of the input (job function)
+ *
+ * \param arg Part (bzlib_part_t)
+ * \return NULL
+ */
+static void *bzlib_part_thread(void *arg)
+{
+	bzlib_part_t *part = (bzlib_part_t*)arg;
+	unsigned char tail[BZ_TAIL_LEN];
+	ssize_t cSize;
+
+	cSize      = bzlib_compress(&part->fin, part->len, tail);
+	part->bits = (cSize < 0 ? -1 : bzlib_blockbits(cSize, tail));
+	return NULL;
+}
+
+
+/**
+ * \brief Return the size (in bits) of the compressed blocks of len bytes of the file
+ *
+ * Since each chunk ends a block, the input is split at chunk boundaries
+ * and the parts are compressed by borrowed idle threads (when there is
+ * any), giving exactly the same bits as a serial compression. Borrowed
+ * threads keep their CPU and NUMA node (see sched_help()).
+ *
+ * \param fin Input file (from current position)
+ * \param len Number of bytes to compress
+ * \return ssize_t Size of the compressed blocks (in bits), -1 on error
+ */
+static ssize_t bzlib_bits(ncd_file_t *fin, size_t len)
+{
+	bzlib_part_t parts[BZ_MAX_PARTS];
+	size_t nchunks, per, start;
+	int i, nparts, helpers;
+	ssize_t bits;
+
+	/* Borrow idle threads */
+	nchunks = (len > 0 ? (len + BZ_FILE_CHUNK - 1) / BZ_FILE_CHUNK : 1);
+	nparts  = (int)(nchunks / BZ_PART_CHUNKS);
+	nparts  = (nparts > BZ_MAX_PARTS ? BZ_MAX_PARTS : nparts);
+	helpers = (nparts > 1 ? sched_borrow(nparts - 1) : 0);
+	nparts  = helpers + 1;
+
+	/* Split input (whole chunks), giving back threads left without any */
+	per     = (nchunks + nparts - 1) / nparts;
+	nparts  = (int)((nchunks + per - 1) / per);
+	sched_giveback(helpers - (nparts - 1));
+	helpers = nparts - 1;
+	per    *= BZ_FILE_CHUNK;
+	start   = fin->fpos;
+	for (i = 0; i < nparts; i++) {
+		parts[i].fin      = *fin;
+		parts[i].fin.fpos = start + i * per;
+		parts[i].len      = (len - i * per < per ? len - i * per : per);
+		parts[i].bits     = -1;
+	}
+
+	/* Compress (other parts on the borrowed threads) */
+	for (i = 1; i < nparts; i++) {
+		sched_lend(&parts[i].job, bzlib_part_thread, &parts[i]);
+	}
+	bzlib_part_thread(&parts[0]);
+
+	bits = 0;
+	for (i = 0; i < nparts; i++) {
+		if (i > 0) {
+			sched_join(&parts[i].job);
+		}
+		if (bits >= 0) {
+			bits = (parts[i].bits < 0 ? -1 : bits + parts[i].bits);
+		}
+	}
+	sched_giveback(helpers);
+	fin->fpos = start + len;
+	return bits;
+}
+
+
+/**
+ * \brief Return the number of bytes from current position to the end of file
+ */
+static size_t bzlib_remaining(ncd_file_t *fin)
+{
+	size_t tsize = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (fin->fileref[i] != NULL) {
+			tsize += fin->fileref[i]->fsize;
+		}
+	}
+	return (tsize - fin->fpos);
+}
+
+
+/**
+ * \brief Return compressed file size using bzlib
+ *
+ * \return ssize_t Compressed size
+ * \note Large inputs are compressed by blocks in parallel (see bzlib_bits())
+ */
+ssize_t bzlib_getcompsize(ncd_file_t *fin)
+{
+	ssize_t cSize, bits;
+	size_t len;
+
+	len = bzlib_remaining(fin);
+	if (len >= (2 * BZ_PART_CHUNKS * BZ_FILE_CHUNK)) {
+		bits  = bzlib_bits(fin, len);
+		cSize = (bits < 0 ? -1 : (bits + BZ_STREAM_OVERHEAD + 7) / 8);
+	} else {
+		cSize = bzlib_compress(fin, (size_t)-1, NULL);
+	}
+	if (cSize < 0) {
+		ncd_err = -1;
+		return 0;
+	}
+	return cSize;
+}
+
+
+/**
+ * \brief Compress the whole blocks of file A for further A+B compressions
+ *
+ * \param fin File A
+ * \return void* Primed state, NULL on error
+ */
+void *bzlib_prefix_open(ncd_file_t *fin)
+{
+	bzlib_prefix_t *pf;
+
+	pf = (bzlib_prefix_t*)malloc(sizeof(bzlib_prefix_t));
+	if (pf == NULL || ncd_fseek(fin, 0, SEEK_SET) < 0) {
+		free(pf);
+		return NULL;
+	}
+
+	/* Blocks of the last (partial) chunk of A depend on B */
+	pf->boundary = (fin->fileref[0]->fsize / BZ_FILE_CHUNK) * BZ_FILE_CHUNK;
+	pf->bits     = 0;
+	if (pf->boundary > 0) {
+		pf->bits = bzlib_bits(fin, pf->boundary);
+		if (pf->bits < 0) {
+			free(pf);
+			return NULL;
+		}
+	}
+	return pf;
+}
+
+
+/**
+ * \brief Return compressed size of A+B reusing the compressed blocks of A
+ *
+ * \param prefix State returned by bzlib_prefix_open()
+ * \param fin Concatenated file (A+B)
+ * \return ssize_t Compressed size
+ */
+ssize_t bzlib_prefix_getcompsize(void *prefix, ncd_file_t *fin)
+{
+	bzlib_prefix_t *pf = (bzlib_prefix_t*)prefix;
+	ssize_t bits;
+
+	if (ncd_fseek(fin, pf->boundary, SEEK_SET) < 0) {
+		ncd_err = -1;
+		return 0;
+	}
+
+	/* Compress from the boundary on */
+	if (pf->boundary == 0) {
+		return bzlib_getcompsize(fin);
+	}
+	bits = bzlib_bits(fin, bzlib_remaining(fin));
+	if (bits < 0) {
+		ncd_err = -1;
+		return 0;
+	}
+
+	/* Join the blocks of both streams (single header and trailer) */
+	bits += pf->bits + BZ_STREAM_OVERHEAD;
+	return ((bits + 7) / 8);
+}
+
+
+/**
+ * \brief Release state returned by bzlib_prefix_open()
+ */
+void bzlib_prefix_close(void *prefix)
+{
+	free(prefix);
+}
 #endif
 
@@ -18,24 +18,41 @@
 #include "ncd.h"
 
 ssize_t ppmd_getcompsize(ncd_file_t *fin);
+void *ppmd_prefix_open(ncd_file_t *fin);
+ssize_t ppmd_prefix_getcompsize(void *prefix, ncd_file_t *fin);
+void ppmd_prefix_close(void *prefix);
 
 #if HAVE_ZLIB
 ssize_t zlib_getcompsize(ncd_file_t *file);
+void *zlib_prefix_open(ncd_file_t *file);
+ssize_t zlib_prefix_getcompsize(void *prefix, ncd_file_t *file);
+void zlib_prefix_close(void *prefix);
 #endif
 #if HAVE_BZLIB
 ssize_t bzlib_getcompsize(ncd_file_t *file);
+void *bzlib_prefix_open(ncd_file_t *file);
+ssize_t bzlib_prefix_getcompsize(void *prefix, ncd_file_t *file);
+void bzlib_prefix_close(void *prefix);
 #endif
 
+/** Memory of each compressor (state plus the copy primed with file A) */
+#define ZLIB_CTXMEM  (2 * (384 << 10))
+#define BZLIB_CTXMEM (1200 << 10)
+#define PPMD_CTXMEM  (2 * (10 << 20) + (1 << 20))
+
 /** Available compressors definitions */
 compressor_t comp_list[] = {
 #if HAVE_ZLIB
-	{"zlib", zlib_getcompsize},
+	{"zlib", zlib_getcompsize, zlib_prefix_open,
+		zlib_prefix_getcompsize, zlib_prefix_close, ZLIB_CTXMEM},
 #endif
 #if HAVE_BZLIB
-	{"bzlib", bzlib_getcompsize},
+	{"bzlib", bzlib_getcompsize, bzlib_prefix_open,
+		bzlib_prefix_getcompsize, bzlib_prefix_close, BZLIB_CTXMEM},
 #endif
-	{"ppmd", ppmd_getcompsize},
-	{NULL, NULL}
+	{"ppmd", ppmd_getcompsize, ppmd_prefix_open,
+		ppmd_prefix_getcompsize, ppmd_prefix_close, PPMD_CTXMEM},
+	{NULL, NULL, NULL, NULL, NULL, 0}
 };
 
 
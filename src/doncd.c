@@ -15,12 +15,15 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <libgen.h>
 #include "ncd.h"
 
@@ -36,44 +39,121 @@ int ncd_threads = 0;
 /** NCD matrix */
 mat_t **ncd_matrix;
 
-/** Thread working indicator */
-char *working = NULL;
-/** Semaphore to access working list */
-sem_t semwk;
+/** Compressed size of each file (written once, before csready is set) */
+static ssize_t *compsizes;
+/** Whether the compressed size of each file is known */
+static atomic_char *csready;
+/** Number of files whose compressed size is known */
+static atomic_ulong csdone;
+/** Remaining uses of each file: pairs plus its single compression (only
+ * when prefetching, to drop the file from page cache after its last use) */
+static atomic_ulong *fuses;
+
+/** Signal threads waiting for compressed sizes */
+static pthread_mutex_t csmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cscond   = PTHREAD_COND_INITIALIZER;
 
 /** Compressor to use on NCD */
 static compressor_t *compalg;
 
+/** NCD options */
+static ncd_opts_t *ncd_opts;
+
 
 /* Prototypes */
-char *get_fullpath(char *basedir, char *filename);
 double calc_NCD(double a, double b, double ab);
-void *thread_calcsize(void *startline);
-void *thread_calcncd(void *startline);
+void symmetrize_mat(mat_t **m, unsigned long n, char policy);
+void *thread_calcsize(void *tid);
+void *thread_calcncd(void *tid);
+
+/**
+ * \brief Return the label of a file on the matrix
+ */
+static char *file_label(file_t *file)
+{
+	return (file->label != NULL ? file->label : basename(file->path));
+}
+
+
+/**
+ * \brief Load the query files and put them before the corpus files
+ *
+ * \param opts NCD options (opts->queries receives the number of queries)
+ * \param total_files Number of files (corpus before, all files after)
+ * \param n_threads Number of threads
+ * \return int 0 on success, -1 otherwise
+ */
+static int join_queries(ncd_opts_t *opts, unsigned long *total_files, int n_threads)
+{
+	unsigned long i, nq;
+	file_t *qfiles, *all;
+	long n;
+
+	if (opts->query_mode == NCD_LISTMODE) {
+		n = scan_list(opts->query, &qfiles, opts, n_threads);
+	} else {
+		n = scan_dir(opts->query, &qfiles, opts, n_threads);
+	}
+	if (n < 0) {
+		return (-1);
+	}
+	nq  = (unsigned long)n;
+	all = (file_t*)malloc(sizeof(file_t) * (nq + *total_files + 1));
+	if (nq == 0 || *total_files == 0 || all == NULL) {
+		if (all != NULL) {
+			fprintf(stderr, "No query or corpus files.\n");
+		} else {
+			perror("doncd()");
+		}
+		for (i = 0; i < nq; i++) {
+			free(qfiles[i].path);
+			sem_destroy(&qfiles[i].lock);
+		}
+		free(qfiles);
+		free(all);
+		return (-1);
+	}
+
+	/* Files (and their locks) are not in use yet */
+	for (i = 0; i < nq + *total_files; i++) {
+		all[i] = (i < nq ? qfiles[i] : ncd_files[i - nq]);
+		sem_destroy(i < nq ? &qfiles[i].lock : &ncd_files[i - nq].lock);
+		sem_init(&all[i].lock, 0, 1);
+	}
+	free(qfiles);
+	free(ncd_files);
+	ncd_files     = all;
+	*total_files += nq;
+	opts->queries = nq;
+	return (0);
+}
+
 
 /**
  * \brief Calculate NCD (Normalized Compression Distance) matrix
  *
  * \param inputA First argument (file or directory)
  * \param inputB Second argument (file)
- * \param compressor Compression algorithm
- * \param mode NCD mode (file or directory)
- * \param csize Should be 1 to return only compressed size of the files (no NCD calculation)
- * \param n_threads Maximum number of threads
+ * \param output Output file (NULL or "-" for stdout)
+ * \param opts NCD options (compressor, mode, number of threads, etc.)
  * \return 0 on success, -1 otherwise
  */
-int do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode, char csize, int n_threads)
+int do_ncd(char *inputA, char *inputB, char *output, ncd_opts_t *opts)
 {
-	unsigned long i, j, total_files, total_de, startline, group_size;
-	char *files[2], *fpath;
-	DIR *idir;
-	struct dirent *de;
+	unsigned long i, j, total_files, rows;
+	char *files[2];
 	struct stat statbuf;
 	FILE *fout = NULL;
-	int res, s;
+	int res, s, n_threads;
+	long tasks, nfiles;
+	char *compressor, mode, csize;
 	pthread_t *threads;
 
-	sem_init(&semwk, 0, 1);
+	ncd_opts   = opts;
+	compressor = opts->compressor;
+	mode       = opts->mode;
+	csize      = opts->csize;
+	n_threads  = opts->n_threads;
 
 	/* Check compressor and do memory allocation for threads */
 	for (i = 0, compalg = NULL; 
@@ -84,15 +164,14 @@ int do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode
 		}
 	}
 
-	if (n_threads <= 0) {
-		n_threads = 1;
+	if (n_threads <= 0 && compalg != NULL) {
+		n_threads = topo_threads(compalg->ctxmem, opts->verbose);
 	}
 	threads     = (pthread_t*)malloc(sizeof(pthread_t) * n_threads);
 	ncd_threads = n_threads;
 
 	if (compalg == NULL || threads == NULL) {
 		if (threads != NULL) free(threads);
-		sem_destroy(&semwk);
 		return (-1);
 	}
 
@@ -114,8 +193,7 @@ int do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode
 	/* Load file information */
 	if (mode == NCD_FILEMODE) {
 		ncd_files = (file_t*)malloc(sizeof(file_t) * 2);
-		working   = (char*)malloc(sizeof(char) * 2);
-		if (ncd_files == NULL || working == NULL) {
+		if (ncd_files == NULL) {
 			perror("doncd()");
 			if (fout) fclose(fout);
 			return (-1);
@@ -140,104 +218,93 @@ int do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode
 					if (fout) fclose(fout);
 					return (-1);
 				} else {
-					ncd_files[i].path      = strdup(files[i]);
-					ncd_files[i].fd        = -1;
-					ncd_files[i].f_errors  = 0;
-					ncd_files[i].fsize     = statbuf.st_size;
-					ncd_files[i].compsize  = -1;
-					ncd_files[i].contents  = NULL;
-					ncd_files[i].reference = 0;
-					sem_init(&ncd_files[i].lock, 0, 1);
+					ncd_file_init(&ncd_files[i], strdup(files[i]), statbuf.st_size);
 				}
 			}
 		}
 	} else if (mode == NCD_DIRMODE) {
-		/* Open input directory */
-		idir = opendir(inputA);
-		if (idir == NULL) {
-			perror(inputA);
+		/* List regular files of input directory */
+		if ((nfiles = scan_dir(inputA, &ncd_files, opts, n_threads)) < 0) {
 			if (fout) fclose(fout);
 			return (-1);
 		}
-
-		/* Count number of entries
-		 * (we won't check entry type now due to performance purposes) */
-		total_de = 0;
-		while ((de = readdir(idir))) {
-			++total_de;
-		}
-		/* Back to the beginning of directory */
-		rewinddir(idir);
-
-		/* Let's allocate memory */
-		ncd_files = (file_t*)malloc(sizeof(file_t) * total_de);
-		working   = (char*)malloc(sizeof(char) * total_de);
-		if (ncd_files == NULL || working == NULL) {
-			perror("doncd()");
-			closedir(idir);
+		total_files = nfiles;
+	} else if (mode == NCD_LISTMODE) {
+		/* Files named by the manifest */
+		if ((nfiles = scan_list(inputA, &ncd_files, opts, n_threads)) < 0) {
 			if (fout) fclose(fout);
 			return (-1);
-		} else {
-			memset(working, 0, (sizeof(char) * total_de));
 		}
-
-		/* Read file information */
-		total_files = 0;
-		while ((de = readdir(idir))) {
-			if (strcmp(de->d_name, ".") == 0 
-					|| strcmp(de->d_name, "..") == 0) {
-				continue;
-			} else {
-				/* Build full path */
-				fpath = get_fullpath(inputA, de->d_name);
-
-				/* Get file information */
-				if (fpath == NULL || stat(fpath, &statbuf) < 0) {
-					perror(fpath);
-					closedir(idir);
-					for (i = 0; i < total_files; i++) {
-						free(ncd_files[i].path);
-					}
-					free(ncd_files);
-					free(working);
-					if (fout) fclose(fout);
-					return (-1);
-				} else {
-					/* Consider only regular files */
-					if ((statbuf.st_mode & S_IFMT) == S_IFREG) {
-						ncd_files[total_files].path      = fpath;
-						ncd_files[total_files].fd        = -1;
-						ncd_files[total_files].f_errors  = 0;
-						ncd_files[total_files].fsize     = statbuf.st_size;
-						ncd_files[total_files].compsize  = -1;
-						ncd_files[total_files].contents  = NULL;
-						ncd_files[total_files].reference = 0;
-						sem_init(&ncd_files[total_files].lock, 0, 1);
-						total_files++;
-					}
-				}
-			}
+		total_files = nfiles;
+	} else if (mode == NCD_TARMODE) {
+		/* Members of the archive (mapped, not extracted) */
+		if ((nfiles = scan_tar(inputA, &ncd_files, opts)) < 0) {
+			if (fout) fclose(fout);
+			return (-1);
 		}
-
-		/* Close directory */
-		closedir(idir);
+		total_files = nfiles;
 	} else {
 		/* Unknown mode */
 		if (fout) fclose(fout);
 		return (-1);
 	}
 
+	/* Rectangular mode: query files come first (matrix lines) */
+	opts->queries = 0;
+	if (opts->query != NULL && join_queries(opts, &total_files, n_threads) < 0) {
+		for (i = 0; i < total_files; i++) {
+			free(ncd_files[i].path);
+			sem_destroy(&ncd_files[i].lock);
+		}
+		free(ncd_files);
+		ncd_tar_free();
+		if (fout) fclose(fout);
+		return (-1);
+	}
+	rows = (opts->queries > 0 ? opts->queries : total_files);
+
 	/* Here we have two possibilities: calculate just compressed
-	 * sizes or the entire NCD matrix. Let assign the matrix 
-	 * (or vector) lines to each thread and start them all */
+	 * sizes or the entire NCD matrix. Threads take the tasks (files
+	 * or matrix tiles) from the scheduler, largest first. Files are
+	 * always compressed alone first, exactly once each */
 	ncd_total_files = total_files;
-	if (csize == 1) {
+	compsizes = (ssize_t*)malloc(sizeof(ssize_t) * (total_files + 1));
+	csready   = (atomic_char*)calloc(total_files + 1, sizeof(atomic_char));
+	atomic_store(&csdone, 0);
+	if (opts->prefetch == NCD_PREFETCH_AUTO) {
+		opts->prefetch = n_threads;
+	}
+	fuses = NULL;
+	if (opts->prefetch > 0) {
+		fuses = (atomic_ulong*)malloc(sizeof(atomic_ulong) * (total_files + 1));
+		for (i = 0; fuses != NULL && i < total_files; i++) {
+			if (csize == 1) {
+				atomic_init(&fuses[i], 1);
+			} else if (opts->queries > 0) {
+				atomic_init(&fuses[i], (i < rows ? total_files - rows : rows) + 1);
+			} else if (opts->symmetric == NCD_SYM_AB) {
+				atomic_init(&fuses[i], total_files);
+			} else {
+				atomic_init(&fuses[i], 2 * (total_files - 1) + 1);
+			}
+		}
+	}
+	ncd_cache_init(opts->map_cache);
+	i = ncd_pack(ncd_files, total_files, n_threads, opts->pack_mem);
+	if (opts->verbose && i > 0) {
+		fprintf(stderr, "Packed files: %lu\n", i);
+	}
+	if (topo_init(n_threads, opts->pin) < 0) {
+		/* Reported by topo_init() */
+		res = -1;
+	} else if (compsizes == NULL || csready == NULL || (opts->prefetch > 0 && fuses == NULL) ||
+			(tasks = sched_init(opts, n_threads, compalg->ctxmem)) < 0) {
+		fprintf(stderr, "Memory allocation error!\n");
+		res = -1;
+	} else if (csize == 1) {
 		/* Calculate only compressed sizes */
-		group_size = total_files / n_threads;
-		for (i = 0, startline = 0; 
-				i < n_threads; 
-				i++, startline += group_size) {
-			pthread_create(&threads[i], NULL, thread_calcsize, (void*)startline);
+		for (i = 0; i < n_threads; i++) {
+			pthread_create(&threads[i], NULL, thread_calcsize, (void*)i);
 		}
 
 		/* Wait for all threads to be done */
@@ -248,19 +315,37 @@ int do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode
 		/* Plot the results */
 		for (i = 0; i < total_files; i++) {
 			/* Doing this way just to keep compatibility with NCD from complearn */
-			printf("%s: %ld\n", ncd_files[i].path, ncd_files[i].compsize);
+			printf("%s: %ld\n", ncd_files[i].path, compsizes[i]);
 		}
 
 		res = 0;
 	} else {
 		/* Alloc memory for NCD matrix */
-		ncd_matrix = new_mat(total_files, total_files);
+		ncd_matrix = new_mat(rows, total_files);
 		if (ncd_matrix == NULL) {
 			res = -1;
 		} else {
 			ncd_err = 0;
+			for (i = 0; i < total_files && opts->queries == 0; i++) {
+				ncd_matrix[i][i] = 0;
+			}
 
 			/* Calculate NCD matrix */
+			if (opts->verbose) {
+				fprintf(stderr, "Files: %lu, threads: %d, tasks: %ld, NUMA nodes: %d\n",
+						total_files, n_threads, tasks, topo_nodes());
+				if (opts->queries > 0) {
+					fprintf(stderr, "Queries: %lu, corpus: %lu\n",
+							opts->queries, total_files - opts->queries);
+				}
+				if (opts->mem_limit > 0) {
+					fprintf(stderr, "Memory limit: %zu MB\n", opts->mem_limit >> 20);
+				}
+				for (i = 0; i < n_threads && opts->pin; i++) {
+					fprintf(stderr, "Thread %lu: node %d, CPU %d\n",
+							i, topo_node(i), topo_cpu(i));
+				}
+			}
 			for (i = 0; i < n_threads; i++) {
 				pthread_create(&threads[i], NULL, thread_calcncd, (void*)i);
 			}
@@ -268,32 +353,55 @@ int do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode
 				pthread_join(threads[i], NULL);
 			}
 
+			for (i = 0; i < (unsigned long)topo_nodes() && opts->verbose; i++) {
+				fprintf(stderr, "Node %lu throughput: %.2f MB/s per thread\n",
+						i, sched_throughput(i));
+			}
+
 			if (ncd_err == 0) {
-				/* Write the results */
-				for (i = 0; i < total_files; i++) {
-					fprintf(fout, "%s ", basename(ncd_files[i].path));
-					for (j = 0; j < total_files; j++) {
+				if (opts->symmetric == NCD_SYM_MIN || opts->symmetric == NCD_SYM_AVG) {
+					symmetrize_mat(ncd_matrix, total_files, opts->symmetric);
+				}
+
+				/* Write the results (rectangular matrix has a header
+				 * with the labels of the columns) */
+				for (j = opts->queries; j < total_files && opts->queries > 0; j++) {
+					fprintf(fout, "%s%s", file_label(&ncd_files[j]),
+							(j + 1 < total_files ? " " : "\n"));
+				}
+				for (i = 0; i < rows; i++) {
+					fprintf(fout, "%s ", file_label(&ncd_files[i]));
+					for (j = opts->queries; j < total_files; j++) {
 						fprintf(fout, "%.6f ", ncd_matrix[i][j]);
 					}
 					fprintf(fout, "\n");
 				}
 
 				/* Release memory */
-				destroy_mat(&ncd_matrix, total_files);
+				destroy_mat(&ncd_matrix, rows);
 			}
 			res = ncd_err;
 		}
 	}
 
 	/* Clean up and return */
+	ncd_cache_free();
+	ncd_pack_free();
+	sched_free();
+	topo_free();
+	free(compsizes);
+	free((void*)csready);
+	free((void*)fuses);
+	fuses     = NULL;
+	compsizes = NULL;
+	csready   = NULL;
 	free(threads);
-	sem_destroy(&semwk);
 	for (i = 0; i < total_files; i++) {
 		free(ncd_files[i].path);
 		sem_destroy(&ncd_files[i].lock);
 	}
 	free(ncd_files);
-	free(working);
+	ncd_tar_free();
 	if (fout != NULL && fout != stdout) fclose(fout);
 	return (res);
 }
@@ -384,175 +492,459 @@ double calc_NCD(double a, double b, double ab)
 
 
 /**
- * \brief Thread function to calculate compressed size
+ * \brief Make NCD matrix symmetric
  *
- * \param startline Which line (at vector containing file information) the thread should start
- * \return NULL
+ * \param m NCD matrix
+ * \param n Matrix order
+ * \param policy NCD_SYM_MIN or NCD_SYM_AVG
+ * \note NCD(A,B) and NCD(B,A) differ only by C(AB) and C(BA), so the minimum
+ *       (or average) of both distances is the distance of min(C(AB),C(BA))
+ *       (or of their average)
  */
-void *thread_calcsize(void *startline)
+void symmetrize_mat(mat_t **m, unsigned long n, char policy)
 {
-	unsigned long i, sl = (unsigned long)startline;
-	ssize_t csize;
-	char turn;
-	ncd_file_t *fp;
+	unsigned long i, j;
+	mat_t v;
 
-	i    = sl;
-	turn = 0;
-	while (i < ncd_total_files && turn < 2) {
-		/* Acquire lock and find some file to work on it */
-		sem_wait(&semwk);
-		if (working[i] != 0) {
-			/* File has been taken by another thread,
-			 * let's try to find another file to work */
-			sem_post(&semwk);
-			i++;
-			if (i >= ncd_total_files) {
-				i = 0;
-				turn++;
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (policy == NCD_SYM_MIN) {
+				v = (m[i][j] <= m[j][i] ? m[i][j] : m[j][i]);
+			} else {
+				v = (m[i][j] + m[j][i]) / 2;
 			}
-			continue;
-		} else {
-			working[i] = 1;
+			m[i][j] = v;
+			m[j][i] = v;
 		}
-		sem_post(&semwk);
-
-		/* Work on the file */
-		fp = ncd_open(&ncd_files[i], NULL);
-		if (fp != NULL) {
-			csize = compalg->get_compressed_size(fp);
-			ncd_files[i].compsize = csize;
-			ncd_close(fp);
+	}
+}
+
+
+/**
+ * \brief Prefetch the files of a task which will be taken later
+ *
+ * \param node NUMA node of the thread
+ */
+static void prefetch_task(int node)
+{
+	ncd_task_t task;
+	unsigned long i;
+
+	if (ncd_opts->prefetch == 0 || !sched_peek(&task, node, ncd_opts->prefetch)) {
+		return;
+	}
+	for (i = task.r0; i < (task.r0 + task.nr); i++) {
+		ncd_advise(&ncd_files[i], NCD_WILLNEED);
+	}
+	if (task.nc == 1) {
+		ncd_advise(&ncd_files[task.c0], NCD_WILLNEED);
+	}
+}
+
+
+/**
+ * \brief Return the end of a column block (files which fit in tile memory)
+ *
+ * \param j First column of the block
+ * \param cend End of the columns of the task
+ * \return unsigned long End of the block
+ */
+static unsigned long colblock_end(unsigned long j, unsigned long cend)
+{
+	unsigned long ncols;
+	size_t tbytes = 0;
+
+	for (ncols = 0; j < cend && ncols < NCD_TILE_COLS; j++, ncols++) {
+		if (ncols > 0 && (tbytes + ncd_files[j].fsize) > ncd_opts->tile_mem) {
+			break;
 		}
+		tbytes += ncd_files[j].fsize;
+	}
+	return (j);
+}
 
-		/* Go to next position */
-		i++;
-		if (i >= ncd_total_files) {
-			i = 0;
-			turn++;
+
+/**
+ * \brief Load small files of a range at once (see ncd_load())
+ *
+ * \param j First file
+ * \param jend End of the range
+ */
+static void load_files(unsigned long j, unsigned long jend)
+{
+	file_t *files[NCD_LOAD_BATCH];
+	unsigned long n;
+
+	while (j < jend) {
+		for (n = 0; j < jend && n < NCD_LOAD_BATCH; j++) {
+			if (ncd_files[j].fsize <= NCD_SMALL_FILE) {
+				files[n++] = &ncd_files[j];
+			}
 		}
+		ncd_load(files, n);
 	}
+}
+
+
+/**
+ * \brief Prefetch the files of a column block
+ *
+ * \param j First column of the block
+ * \param cend End of the columns of the task
+ */
+static void prefetch_colblock(unsigned long j, unsigned long cend)
+{
+	unsigned long jend;
 
+	if (ncd_opts->prefetch == 0) {
+		return;
+	}
+	for (jend = colblock_end(j, cend); j < jend; j++) {
+		ncd_advise(&ncd_files[j], NCD_WILLNEED);
+	}
+}
+
+
+/**
+ * \brief Account a use of a file, dropping it from page cache after the last one
+ *
+ * \param i File index
+ */
+static void file_used(unsigned long i)
+{
+	if (fuses != NULL && atomic_fetch_sub(&fuses[i], 1) == 1) {
+		ncd_advise(&ncd_files[i], NCD_DONTNEED);
+	}
+}
+
+
+/**
+ * \brief Compress a single file and publish its compressed size
+ *
+ * \param task Task (file in task->r0)
+ * \param node NUMA node of the thread
+ */
+static void calc_single(ncd_task_t *task, int node)
+{
+	ssize_t csize = -1;
+	ncd_file_t *fp;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	prefetch_task(node);
+	fp = ncd_open(&ncd_files[task->r0], NULL);
+	if (fp != NULL) {
+		csize = compalg->get_compressed_size(fp);
+		ncd_close(fp);
+	}
+	file_used(task->r0);
+	compsizes[task->r0] = csize;
+	atomic_store_explicit(&csready[task->r0], 1, memory_order_release);
+	atomic_fetch_add(&csdone, 1);
+	sched_done(task, &start, node);
+
+	/* Wake up threads waiting for it */
+	pthread_mutex_lock(&csmutex);
+	pthread_cond_broadcast(&cscond);
+	pthread_mutex_unlock(&csmutex);
+}
+
+
+/**
+ * \brief Compress files alone while there are files to take
+ *
+ * \param node NUMA node of the thread
+ */
+static void calc_singles(int node)
+{
+	ncd_task_t tasks[NCD_LOAD_BATCH];
+	file_t *files[NCD_LOAD_BATCH];
+	size_t mem;
+	int i, n;
+
+	while ((n = sched_next_files(tasks, NCD_LOAD_BATCH, node)) > 0) {
+		mem = compalg->ctxmem;
+		for (i = 0; i < n; i++) {
+			mem += ncd_files[tasks[i].r0].fsize;
+		}
+		sched_reserve(mem);
+
+		/* Batch of small files are loaded at once */
+		for (i = 0; i < n && n > 1; i++) {
+			files[i] = &ncd_files[tasks[i].r0];
+		}
+		if (n > 1) {
+			ncd_load(files, n);
+		}
+		for (i = 0; i < n; i++) {
+			calc_single(&tasks[i], node);
+		}
+		sched_release(mem);
+	}
+}
+
+
+/**
+ * \brief Wait until the compressed sizes of all files are known
+ */
+static void wait_singles(void)
+{
+	pthread_mutex_lock(&csmutex);
+	while (atomic_load(&csdone) < ncd_total_files) {
+		pthread_cond_wait(&cscond, &csmutex);
+	}
+	pthread_mutex_unlock(&csmutex);
+}
+
+
+/**
+ * \brief Estimate the memory used by a matrix task
+ *
+ * \param task Task
+ * \return size_t Bytes of files A, of the largest column block and of the
+ *         compressor states (one primed state for each file A)
+ */
+static size_t task_mem(ncd_task_t *task)
+{
+	unsigned long i, j, jend, cend;
+	size_t mem, block, maxblock;
+
+	mem = compalg->ctxmem + (task->nr - 1) * (compalg->ctxmem / 2);
+	for (i = task->r0; i < (task->r0 + task->nr); i++) {
+		mem += ncd_files[i].fsize;
+	}
+	cend = task->c0 + task->nc;
+	for (j = task->c0, maxblock = 0; j < cend; j = jend) {
+		jend = colblock_end(j, cend);
+		for (block = 0; j < jend; j++) {
+			block += ncd_files[j].fsize;
+		}
+		maxblock = (block > maxblock ? block : maxblock);
+	}
+	return (mem + maxblock);
+}
+
+
+/**
+ * \brief Thread function to calculate compressed size
+ *
+ * \param tid Thread index
+ * \return NULL
+ */
+void *thread_calcsize(void *tid)
+{
+	int node = topo_node((long)tid);
+
+	if (topo_bind((long)tid) < 0) {
+		perror("pthread_setaffinity_np()");
+	}
+	calc_singles(node);
+
+	/* Let this thread help on the remaining files */
+	sched_help();
 	return (NULL);
 }
 
 
+/**
+ * \brief Return compressed size of a single file
+ *
+ * \param i File index
+ * \param node NUMA node of the thread
+ * \return ssize_t Compressed size, -1 on error
+ * \note If the size is not known yet, help to compress the remaining
+ *       files (or wait for the thread which is compressing it)
+ */
+static ssize_t get_compsize(unsigned long i, int node)
+{
+	ncd_task_t task;
+
+	if (atomic_load_explicit(&csready[i], memory_order_acquire)) {
+		return (compsizes[i]);
+	}
+
+	while (sched_next_file(&task, node)) {
+		calc_single(&task, node);
+		if (atomic_load_explicit(&csready[i], memory_order_acquire)) {
+			return (compsizes[i]);
+		}
+	}
+
+	pthread_mutex_lock(&csmutex);
+	while (!atomic_load_explicit(&csready[i], memory_order_acquire)) {
+		pthread_cond_wait(&cscond, &csmutex);
+	}
+	pthread_mutex_unlock(&csmutex);
+	return (compsizes[i]);
+}
+
+
 /**
  * \brief Calculate NCD matrix
  *
- * \param startline Which line (at vector containing file information) the thread should start
+ * \param tid Thread index
  * \return NULL
- * \note Each vector position represents one matrix line, so one thread 
- *       should proccess the entire matrix line
+ * \note The matrix is calculated in tiles: each task covers a block of
+ *       (tile_rows) lines and the columns are walked in blocks of files
+ *       whose total size fits in tile_mem bytes. All files of a column block
+ *       are kept mapped while they are used by every line of the block, and
+ *       files A stay opened (with their compressor prefixes) for the whole
+ *       task. On symmetric (ab) mode only the upper part of the lines is
+ *       calculated and mirrored. Threads compress all files alone first, so
+ *       pair tasks start as soon as there are no more single files to take.
  */
-void *thread_calcncd(void *startline)
+void *thread_calcncd(void *tid)
 {
-	unsigned long i, j, sl = (unsigned long)startline;
+	unsigned long i, j, jt, cend, ncols;
 	ssize_t csizes[] = {0, 0, 0};
-	char turn;
-	int k;
-	ncd_file_t *fa, *fp;
-
-	i    = sl;
-	turn = 0;
-	while (i < ncd_total_files && turn < 2) {
-		/* Acquire lock and find some line (file) to work on it */
-		sem_wait(&semwk);
-		if (working[i] != 0) {
-			/* Line has been taken by another thread,
-			 * let's try to find another line to work */
-			sem_post(&semwk);
-			if (turn == 0) {
-				i += ncd_threads; /* trying to be smart */
-			} else {
-				i++;
-			}
-			if (i >= ncd_total_files) {
-				i = 0;
-				turn++;
-			}
-			continue;
-		} else {
-			working[i] = 1;
-		}
-		sem_post(&semwk);
+	size_t tbytes, mem;
+	ncd_task_t task;
+	ncd_file_t **fa, **fb, *fp;
+	void **prefix;
+	struct timespec start;
+	int node = topo_node((long)tid);
+
+	/* Pin thread before allocating anything, so its memory (including
+	 * compressor states) stays on its NUMA node */
+	if (topo_bind((long)tid) < 0) {
+		perror("pthread_setaffinity_np()");
+	}
 
-		/* Work on the entire matrix line */
+	fa     = (ncd_file_t**)calloc(ncd_opts->tile_rows, sizeof(ncd_file_t*));
+	prefix = (void**)calloc(ncd_opts->tile_rows, sizeof(void*));
+	fb     = (ncd_file_t**)calloc(NCD_TILE_COLS, sizeof(ncd_file_t*));
+	if (fa == NULL || prefix == NULL || fb == NULL) {
+		ncd_err = -2;
+		free(fa); free(prefix); free(fb);
+		sched_help();
+		return (NULL);
+	}
 
-		/* Get compressed size of all files: A, B and AB (concatenated)
-		 * checking if we already know the compressed size of each of them */
-		sem_wait(&ncd_files[i].lock);
-		if (ncd_files[i].compsize > 0) {
-			csizes[0] = ncd_files[i].compsize;
-		} else {
-			csizes[0] = -1;
+	/* First phase: compressed size of each file. With a memory budget,
+	 * tasks can't hold memory while waiting for single files (which
+	 * could be waiting for memory), so all of them must be done first */
+	calc_singles(node);
+	if (ncd_opts->mem_limit > 0) {
+		wait_singles();
+	}
+
+	/* Second phase: matrix tasks */
+	while (ncd_err == 0 && sched_next(&task, node)) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		prefetch_task(node);
+
+		/* Columns to calculate */
+		j    = task.c0;
+		cend = task.c0 + task.nc;
+		if (ncd_opts->symmetric == NCD_SYM_AB && j <= task.r0) {
+			j = task.r0 + 1;
 		}
-		sem_post(&ncd_files[i].lock);
-		
-		/* let file A opened to keep mapped at memory */
-		fa = ncd_open(&ncd_files[i], NULL);
-		if (fa == NULL) {
-			ncd_err = -2;
-			return (NULL);
-		} else if (csizes[0] == -1) {
-			csizes[0] = compalg->get_compressed_size(fa);
-			ncd_files[i].compsize = csizes[0];
+		if (j >= cend || (task.nr == 1 && task.nc == 1 && task.r0 == task.c0)) {
+			/* Nothing to do (diagonal or below it) */
+			continue;
+		}
+		mem = task_mem(&task);
+		sched_reserve(mem);
+
+		/* Let files A opened to keep mapped at memory, and compress each
+		 * one only once for the entire line (when supported by the
+		 * compressor and worth it), each AB will compress only B from there */
+		load_files(task.r0, task.r0 + task.nr);
+		for (i = 0; i < task.nr; i++) {
+			fa[i] = ncd_open(&ncd_files[task.r0 + i], NULL);
+			if (fa[i] == NULL) {
+				ncd_err = -2;
+				break;
+			}
+			prefix[i] = NULL;
+			if (compalg->prefix_open != NULL && task.nc > 1) {
+				prefix[i] = compalg->prefix_open(fa[i]);
+			}
 		}
 
-		for (j = 0; j < ncd_total_files; j++) {
-			if (i == j) {
-				ncd_matrix[i][j] = 0;
-				continue;
+		/* Walk through column blocks */
+		while (j < cend && ncd_err == 0) {
+			/* Open (map, or load small ones) all files of the block */
+			load_files(j, colblock_end(j, cend));
+			tbytes = 0;
+			for (jt = j, ncols = 0; jt < cend && ncols < NCD_TILE_COLS; jt++, ncols++) {
+				if (ncols > 0 && (tbytes + ncd_files[jt].fsize) > ncd_opts->tile_mem) {
+					break;
+				}
+				tbytes   += ncd_files[jt].fsize;
+				fb[ncols] = ncd_open(&ncd_files[jt], NULL);
+				if (fb[ncols] == NULL) {
+					ncd_err = -2;
+					ncols++;
+					break;
+				}
 			}
-			for (k = 1; k < 3; k++) {
-				if (k < 2) {
-					/* Single file */
-					sem_wait(&ncd_files[j].lock);
-					if (ncd_files[j].compsize > 0) {
-						csizes[1] = ncd_files[j].compsize;
-						sem_post(&ncd_files[j].lock);
-					} else {
-						sem_post(&ncd_files[j].lock);
-						fp = ncd_open(&ncd_files[j], NULL);
-						if (fp != NULL) {
-							csizes[1] = compalg->get_compressed_size(fp);
-							ncd_files[j].compsize = csizes[1];
-							ncd_close(fp);
-						} else {
-							ncd_err = -2;
-							break;
-						}
+
+			/* Read the next block while this one is calculated */
+			prefetch_colblock(j + ncols, cend);
+
+			/* Calculate the tile */
+			for (i = task.r0; i < (task.r0 + task.nr) && ncd_err == 0; i++) {
+				for (jt = j; jt < (j + ncols); jt++) {
+					if (i == jt || (ncd_opts->symmetric == NCD_SYM_AB && jt < i)) {
+						continue;
 					}
-				} else {
+
 					/* Concatenated file */
-					fp = ncd_open(&ncd_files[i], &ncd_files[j]);
-					if (fp != NULL) {
-						csizes[2] = compalg->get_compressed_size(fp);
-						ncd_close(fp);
+					fp = ncd_open(&ncd_files[i], &ncd_files[jt]);
+					if (fp == NULL) {
+						ncd_err = -2;
+						break;
+					} else if (prefix[i - task.r0] != NULL) {
+						csizes[2] = compalg->prefix_getcompsize(prefix[i - task.r0], fp);
 					} else {
+						csizes[2] = compalg->get_compressed_size(fp);
+					}
+					ncd_close(fp);
+
+					/* Compute NCD (single sizes are read after compressing
+					 * AB, when they are probably known already) */
+					csizes[0] = get_compsize(i, node);
+					csizes[1] = get_compsize(jt, node);
+					if (csizes[0] < 0 || csizes[1] < 0 || csizes[2] < 0) {
 						ncd_err = -2;
 						break;
 					}
+					ncd_matrix[i][jt] = calc_NCD((double)csizes[0], (double)csizes[1], (double)csizes[2]);
+					if (ncd_opts->symmetric == NCD_SYM_AB) {
+						ncd_matrix[jt][i] = ncd_matrix[i][jt];
+					}
+					file_used(i);
+					file_used(jt);
 				}
 			}
 
-			/* Compute NCD */
-			ncd_matrix[i][j] = calc_NCD((double)csizes[0], (double)csizes[1], (double)csizes[2]);
-		}
-		/* Close file A */
-		ncd_close(fa);
-		
-		/* Go to next line */
-		if (turn == 0) {
-			i += ncd_threads;
-		} else {
-			i++;
+			/* Close files of the block */
+			for (jt = 0; jt < ncols; jt++) {
+				ncd_close(fb[jt]);
+				fb[jt] = NULL;
+			}
+			j += ncols;
 		}
-		if (i >= ncd_total_files) {
-			i = 0;
-			turn++;
+
+		/* Close files A */
+		for (i = 0; i < task.nr; i++) {
+			if (prefix[i] != NULL) {
+				compalg->prefix_close(prefix[i]);
+				prefix[i] = NULL;
+			}
+			ncd_close(fa[i]);
+			fa[i] = NULL;
 		}
+		sched_release(mem);
+		sched_done(&task, &start, node);
 	}
 
+	free(fa);
+	free(prefix);
+	free(fb);
+
+	/* Let this thread help on the remaining tasks */
+	sched_help();
 	return (NULL);
 }
-
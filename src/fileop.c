@@ -14,6 +14,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -21,11 +22,414 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/mman.h>
 #include "ncd.h"
 
 extern file_t *ncd_files;
 
+/** Mapping cache: unused files kept in memory, most recently used first */
+static file_t *lru_head = NULL, *lru_tail = NULL;
+/** Size of the cache (0 = disabled) and of the files on it */
+static size_t cache_max = 0, cache_used = 0;
+/** Lock of the cache list (taken after the lock of a file, never before) */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Arena of small files (read-only after ncd_pack()) */
+static unsigned char *arena = NULL;
+static size_t arena_len = 0;
+
+/** Files to be read into the arena, with their offsets */
+typedef struct _pack_t {
+	/** Files */
+	file_t **files;
+	/** Offset of each file in the arena */
+	size_t *offset;
+	/** Number of files */
+	unsigned long n;
+	/** Next file to be read by a thread */
+	atomic_ulong next;
+} pack_t;
+
+
+/**
+ * \brief Release the contents of a file (unmap or free them)
+ *
+ * \param file File (its lock must be held)
+ */
+static void file_release(file_t *file)
+{
+	if (file->heap) {
+		free(file->contents);
+		file->heap = 0;
+	} else if (file->contents != NULL) {
+		munmap(file->contents, file->fsize);
+	}
+	if (file->fd >= 0) {
+		close(file->fd);
+	}
+	file->fd       = -1;
+	file->contents = NULL;
+}
+
+
+/**
+ * \brief Remove a file from the cache list (cache_mutex must be held)
+ */
+static void cache_unlink(file_t *file)
+{
+	if (file->lru_prev != NULL) {
+		file->lru_prev->lru_next = file->lru_next;
+	} else {
+		lru_head = file->lru_next;
+	}
+	if (file->lru_next != NULL) {
+		file->lru_next->lru_prev = file->lru_prev;
+	} else {
+		lru_tail = file->lru_prev;
+	}
+	file->lru_prev = NULL;
+	file->lru_next = NULL;
+	file->cached   = 0;
+	cache_used    -= file->fsize;
+}
+
+
+/**
+ * \brief Take a file out of the cache, if it's there
+ *
+ * \param file File (its lock must be held)
+ */
+static void cache_take(file_t *file)
+{
+	pthread_mutex_lock(&cache_mutex);
+	if (file->cached) {
+		cache_unlink(file);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/**
+ * \brief Keep an unused file in the cache
+ *
+ * \param file File (its lock must be held)
+ * \return int 1 if the file was cached, 0 otherwise (it must be released)
+ */
+static int cache_put(file_t *file)
+{
+	if (cache_max == 0 || (size_t)file->fsize > cache_max) {
+		return (0);
+	}
+
+	/* The mapping stays valid without the descriptor, so cached files
+	 * don't take any descriptor from RLIMIT_NOFILE */
+	if (file->fd >= 0) {
+		close(file->fd);
+		file->fd = -1;
+	}
+
+	pthread_mutex_lock(&cache_mutex);
+	file->lru_prev = NULL;
+	file->lru_next = lru_head;
+	if (lru_head != NULL) {
+		lru_head->lru_prev = file;
+	} else {
+		lru_tail = file;
+	}
+	lru_head      = file;
+	file->cached  = 1;
+	cache_used   += file->fsize;
+	pthread_mutex_unlock(&cache_mutex);
+	return (1);
+}
+
+
+/**
+ * \brief Evict least recently used files while the cache is over its size
+ *
+ * With the cache disabled, every file is evicted (empty files take no
+ * space, so they would stay in the list otherwise).
+ *
+ * \note No file lock can be held by the caller
+ */
+static void cache_trim(void)
+{
+	file_t *file;
+
+	while (1) {
+		pthread_mutex_lock(&cache_mutex);
+		if (lru_tail == NULL || (cache_max > 0 && cache_used <= cache_max)) {
+			pthread_mutex_unlock(&cache_mutex);
+			break;
+		}
+		file = lru_tail;
+		cache_unlink(file);
+		pthread_mutex_unlock(&cache_mutex);
+
+		/* Release it unless it was opened (or cached again) meanwhile */
+		sem_wait(&file->lock);
+		pthread_mutex_lock(&cache_mutex);
+		if (!file->cached && file->reference == 0) {
+			file_release(file);
+		}
+		pthread_mutex_unlock(&cache_mutex);
+		sem_post(&file->lock);
+	}
+}
+
+
+/**
+ * \brief Check that a file has the size it was listed with
+ *
+ * Sizes may come from a manifest (see scan_list()) or the file may have
+ * changed since it was listed: mapping past its end would crash the
+ * program and reading less would give wrong results.
+ *
+ * \param file File
+ * \param fd File descriptor
+ * \param report Print the mismatch on stderr (the file lock must be held)
+ * \return int 0 if the size matches, -1 otherwise
+ */
+static int file_check(file_t *file, int fd, int report)
+{
+	struct stat st;
+	int ret;
+
+	if ((ret = fstat(fd, &st)) == 0 && st.st_size == file->fsize) {
+		return (0);
+	}
+	/* Report each file once */
+	if (report && !file->f_errors) {
+		if (ret < 0) {
+			perror(file->path);
+		} else {
+			fprintf(stderr, "%s: size is %lld bytes, %zd expected\n",
+					file->path, (long long)st.st_size, file->fsize);
+		}
+		file->f_errors = 1;
+	}
+	return (-1);
+}
+
+
+/**
+ * \brief Read files into the arena (thread function)
+ *
+ * \param arg Files to read (pack_t)
+ * \return NULL
+ */
+static void *pack_thread(void *arg)
+{
+	pack_t *pk = (pack_t*)arg;
+	unsigned long k;
+	ssize_t rd, cnt;
+	unsigned char *dst;
+	file_t *file;
+	int fd;
+
+	while ((k = atomic_fetch_add(&pk->next, 1)) < pk->n) {
+		file = pk->files[k];
+		dst  = &arena[pk->offset[k]];
+		if ((fd = open(file->path, O_RDONLY)) < 0) {
+			continue;
+		} else if (file_check(file, fd, 0) < 0) {
+			/* Reported by ncd_open() */
+			close(fd);
+			continue;
+		}
+		for (cnt = 0; cnt < file->fsize; cnt += rd) {
+			rd = pread(fd, &dst[cnt], file->fsize - cnt, cnt);
+			if (rd <= 0) {
+				break;
+			}
+		}
+		close(fd);
+
+		/* Files which fail (or changed) are left to ncd_open() */
+		if (cnt == file->fsize) {
+			file->contents = dst;
+			file->packed   = NCD_PACKED_ARENA;
+		}
+	}
+	return (NULL);
+}
+
+
+/**
+ * \brief Read small files into a single read-only arena
+ *
+ * Files up to NCD_SMALL_FILE are read once, in parallel, and their contents
+ * point into the arena for the whole run: they are never mapped, read or
+ * released again (see ncd_open() and ncd_close()).
+ *
+ * \param files Files
+ * \param n Number of files
+ * \param n_threads Number of threads to read the files
+ * \param bytes Maximum size of the arena
+ * \return unsigned long Number of files packed
+ */
+unsigned long ncd_pack(file_t *files, unsigned long n, int n_threads, size_t bytes)
+{
+	pthread_t *threads;
+	unsigned long i, packed;
+	pack_t pk;
+	int t;
+
+	pk.files  = (file_t**)malloc(sizeof(file_t*) * (n + 1));
+	pk.offset = (size_t*)malloc(sizeof(size_t) * (n + 1));
+	threads   = (pthread_t*)malloc(sizeof(pthread_t) * (n_threads + 1));
+	if (pk.files == NULL || pk.offset == NULL || threads == NULL) {
+		free(pk.files); free(pk.offset); free(threads);
+		return (0);
+	}
+
+	/* Lay out the files (in order) while they fit */
+	arena_len = 0;
+	for (i = 0, pk.n = 0; i < n; i++) {
+		if (files[i].fsize > 0 && files[i].fsize <= NCD_SMALL_FILE && !files[i].packed &&
+				(arena_len + files[i].fsize) <= bytes) {
+			pk.files[pk.n]    = &files[i];
+			pk.offset[pk.n++] = arena_len;
+			arena_len        += files[i].fsize;
+		}
+	}
+	if (pk.n < 2) {
+		/* Not worth it */
+		arena_len = 0;
+		free(pk.files); free(pk.offset); free(threads);
+		return (0);
+	}
+
+	arena = (unsigned char*)mmap(NULL, arena_len, PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == (unsigned char*)MAP_FAILED) {
+		arena     = NULL;
+		arena_len = 0;
+		free(pk.files); free(pk.offset); free(threads);
+		return (0);
+	}
+
+	/* Read */
+	atomic_init(&pk.next, 0);
+	for (t = 1; t < n_threads; t++) {
+		if (pthread_create(&threads[t], NULL, pack_thread, &pk) != 0) {
+			break;
+		}
+	}
+	pack_thread(&pk);
+	while (--t > 0) {
+		pthread_join(threads[t], NULL);
+	}
+	mprotect(arena, arena_len, PROT_READ);
+
+	for (i = 0, packed = 0; i < pk.n; i++) {
+		packed += (pk.files[i]->packed != 0);
+	}
+	free(pk.files);
+	free(pk.offset);
+	free(threads);
+	return (packed);
+}
+
+
+/**
+ * \brief Release the arena of small files
+ */
+void ncd_pack_free(void)
+{
+	if (arena != NULL) {
+		munmap(arena, arena_len);
+	}
+	arena     = NULL;
+	arena_len = 0;
+}
+
+
+/**
+ * \brief Set the size of the mapping cache
+ *
+ * \param bytes Maximum size of the unused files kept in memory (0 = disabled)
+ */
+void ncd_cache_init(size_t bytes)
+{
+	cache_max  = bytes;
+	cache_used = 0;
+	lru_head   = NULL;
+	lru_tail   = NULL;
+}
+
+
+/**
+ * \brief Release all files of the mapping cache
+ */
+void ncd_cache_free(void)
+{
+	cache_max = 0;
+	cache_trim();
+}
+
+
+/**
+ * \brief Read the whole file into memory
+ *
+ * \param file File (its lock must be held)
+ * \return int 0 on success, -1 otherwise
+ */
+static int ncd_read(file_t *file)
+{
+	ssize_t rd, cnt;
+	int fd;
+
+	if ((fd = open(file->path, O_RDONLY)) < 0) {
+		return (-1);
+	} else if (file_check(file, fd, 1) < 0) {
+		close(fd);
+		return (-1);
+	}
+	/* Empty files get a (non NULL) buffer too */
+	file->contents = (unsigned char*)malloc(file->fsize > 0 ? file->fsize : 1);
+	for (cnt = 0; file->contents != NULL && cnt < file->fsize; cnt += rd) {
+		rd = pread(fd, &file->contents[cnt], file->fsize - cnt, cnt);
+		if (rd <= 0) {
+			break;
+		}
+	}
+	close(fd);
+
+	if (file->contents == NULL || cnt < file->fsize) {
+		free(file->contents);
+		file->contents = NULL;
+		return (-1);
+	}
+	file->heap = 1;
+	return (0);
+}
+
+
+/**
+ * \brief Initialize a file structure
+ *
+ * \param file File
+ * \param path File path (allocated with malloc())
+ * \param fsize File size
+ */
+void ncd_file_init(file_t *file, char *path, ssize_t fsize)
+{
+	file->path      = path;
+	file->label     = NULL;
+	file->fd        = -1;
+	file->f_errors  = 0;
+	file->fsize     = fsize;
+	file->contents  = NULL;
+	file->reference = 0;
+	file->heap      = 0;
+	file->packed    = 0;
+	file->cached    = 0;
+	sem_init(&file->lock, 0, 1);
+}
+
 
 /**
  * \brief Open a single or concatenated file
@@ -59,11 +463,34 @@ ncd_file_t *ncd_open(file_t *fileA, file_t *fileB)
 		sem_wait(&fp->fileref[i]->lock);
 
 		/* Check memory mapping */
-		if (fp->fileref[i]->reference <= 0) {
+		if (fp->fileref[i]->reference <= 0 && fp->fileref[i]->contents != NULL) {
+			/* Contents already loaded (see ncd_load()) or cached */
+			cache_take(fp->fileref[i]);
+		} else if (fp->fileref[i]->reference <= 0 && fp->fileref[i]->fsize <= NCD_SMALL_FILE) {
+			/* Small (and empty) files are just read into memory */
+			if (ncd_read(fp->fileref[i]) < 0) {
+				sem_post(&fp->fileref[i]->lock);
+				fp->fileref[i] = NULL;
+				if (i == 0) {
+					fp->fileref[1] = NULL;
+				}
+				ncd_close(fp);
+				return (NULL);
+			}
+		} else if (fp->fileref[i]->reference <= 0) {
 			/* Open and map file to memory */
-			if ((fp->fileref[i]->fd = open(fp->fileref[i]->path, O_RDONLY)) < 0) {
+			if ((fp->fileref[i]->fd = open(fp->fileref[i]->path, O_RDONLY)) < 0 ||
+					file_check(fp->fileref[i], fp->fileref[i]->fd, 1) < 0) {
+				if (fp->fileref[i]->fd >= 0) {
+					close(fp->fileref[i]->fd);
+					fp->fileref[i]->fd = -1;
+				}
 				sem_post(&fp->fileref[i]->lock);
-				free(fp);
+				fp->fileref[i] = NULL;
+				if (i == 0) {
+					fp->fileref[1] = NULL;
+				}
+				ncd_close(fp);
 				return (NULL);
 			}
 
@@ -72,10 +499,14 @@ ncd_file_t *ncd_open(file_t *fileA, file_t *fileB)
 												fp->fileref[i]->fd, 0);
 			if (fcontents == (unsigned char*)MAP_FAILED) {
 				close(fp->fileref[i]->fd);
-				fp->fileref[i] = NULL;
+				fp->fileref[i]->fd = -1;
 				sem_post(&fp->fileref[i]->lock);
+				fp->fileref[i] = NULL;
+				if (i == 0) {
+					fp->fileref[1] = NULL;
+				}
 				ncd_close(fp);
-				break;
+				return (NULL);
 			} else {
 				fp->fileref[i]->contents = fcontents;
 				fcontents = NULL;
@@ -113,14 +544,13 @@ void ncd_close(ncd_file_t *fp)
 		/* Acquire lock */
 		sem_wait(&fp->fileref[i]->lock);
 
-		/* Decrease reference */
+		/* Decrease reference: unused files are kept in the cache (so
+		 * they aren't mapped again for each line), or released */
 		fp->fileref[i]->reference--;
-		if (fp->fileref[i]->reference == 0) {
-			/* Unmap and close file */
-			munmap(fp->fileref[i]->contents, fp->fileref[i]->fsize);
-			close(fp->fileref[i]->fd);
-			fp->fileref[i]->fd       = -1;
-			fp->fileref[i]->contents = NULL;
+		if (fp->fileref[i]->reference == 0 && fp->fileref[i]->packed) {
+			/* Stays in the arena (or archive) */
+		} else if (fp->fileref[i]->reference == 0 && !cache_put(fp->fileref[i])) {
+			file_release(fp->fileref[i]);
 		}
 
 		/* Release lock */
@@ -130,6 +560,7 @@ void ncd_close(ncd_file_t *fp)
 	/* Release memory */
 	free(fp);
 	fp = NULL;
+	cache_trim();
 }
 
 
@@ -207,6 +638,48 @@ ssize_t ncd_fread(void *ptr, size_t size, size_t nmemb, ncd_file_t *stream)
 }
 
 
+/**
+ * \brief Get the next contiguous data of the stream, without copying it
+ *
+ * \param stream NCD file stream
+ * \param ptr Receives a pointer to the data (inside file contents)
+ * \param maxlen Maximum number of bytes to return
+ * \return ssize_t Number of bytes available at ptr (0 on end of file)
+ * \note A concatenated file is returned at least in two segments, one for
+ *       each file. The stream position is advanced by the returned size.
+ */
+ssize_t ncd_fsegment(ncd_file_t *stream, const unsigned char **ptr, size_t maxlen)
+{
+	int i;
+	size_t start, cnt;
+	file_t *f;
+
+	if (ptr == NULL || stream == NULL) {
+		return (0);
+	}
+
+	for (i = 0, start = 0; i < 2; i++) {
+		f = stream->fileref[i];
+		if (f == NULL) {
+			continue;
+		}
+		if (stream->fpos < (start + f->fsize)) {
+			cnt = (start + f->fsize) - stream->fpos;
+			if (cnt > maxlen) {
+				cnt = maxlen;
+			}
+			*ptr = &f->contents[stream->fpos - start];
+			stream->fpos += cnt;
+			return (cnt);
+		}
+		start += f->fsize;
+	}
+
+	/* End of file reached */
+	return (0);
+}
+
+
 /**
  * \brief Reads the next character from stream
  *
@@ -290,3 +763,104 @@ int ncd_feof(ncd_file_t *stream)
 	}
 }
 
+
+/**
+ * \brief Set file position
+ *
+ * \param stream NCD file stream
+ * \param offset Offset (in bytes) relative to whence
+ * \param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * \return int 0 on success, -1 otherwise
+ */
+int ncd_fseek(ncd_file_t *stream, long offset, int whence)
+{
+	int i;
+	long base, tsize;
+
+	if (stream == NULL) {
+		return (-1);
+	}
+
+	tsize = 0;
+	for (i = 0; i < 2; i++) {
+		if (stream->fileref[i] != NULL) {
+			tsize += stream->fileref[i]->fsize;
+		}
+	}
+
+	switch (whence) {
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = (long)stream->fpos;
+			break;
+		case SEEK_END:
+			base = tsize;
+			break;
+		default:
+			return (-1);
+	}
+
+	if ((base + offset) < 0 || (base + offset) > tsize) {
+		return (-1);
+	}
+	stream->fpos = (unsigned long)(base + offset);
+	return (0);
+}
+
+
+/**
+ * \brief Give the kernel advice about the use of a file in the near future
+ *
+ * \param file File
+ * \param advice NCD_WILLNEED (start reading it in background) or
+ *        NCD_DONTNEED (it will not be used anymore)
+ * \return int 0 on success, -1 otherwise
+ * \note Mapped files are advised through their mapping, the others are
+ *       opened just to advise the page cache
+ */
+int ncd_advise(file_t *file, int advice)
+{
+	int fd, ret = 0;
+	size_t off;
+
+	if (file == NULL || file->fsize == 0) {
+		return (0);
+	} else if (file->packed == NCD_PACKED_TAR && advice == NCD_WILLNEED) {
+		/* Members aren't page aligned inside the archive */
+		off = (size_t)file->contents % sysconf(_SC_PAGESIZE);
+		return (madvise(file->contents - off, file->fsize + off, MADV_WILLNEED));
+	} else if (file->packed) {
+		return (0);
+	}
+
+	sem_wait(&file->lock);
+	if (file->reference == 0 && file->contents != NULL && advice == NCD_DONTNEED) {
+		/* Pages can't be dropped while they are mapped */
+		cache_take(file);
+		file_release(file);
+	} else if (file->reference == 0 && file->contents != NULL) {
+		/* Cached */
+		sem_post(&file->lock);
+		return (file->heap ? 0 : madvise(file->contents, file->fsize, MADV_WILLNEED));
+	}
+	if (file->heap && advice == NCD_WILLNEED) {
+		/* Already in memory */
+		sem_post(&file->lock);
+		return (0);
+	} else if (file->reference > 0 && advice == NCD_WILLNEED) {
+		ret = madvise(file->contents, file->fsize, MADV_WILLNEED);
+		sem_post(&file->lock);
+		return (ret);
+	}
+	sem_post(&file->lock);
+
+	if ((fd = open(file->path, O_RDONLY)) < 0) {
+		return (-1);
+	}
+	ret = posix_fadvise(fd, 0, 0, (advice == NCD_WILLNEED ?
+				POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED));
+	close(fd);
+	return (ret == 0 ? 0 : -1);
+}
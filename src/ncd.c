@@ -25,6 +25,25 @@ int ncd_err = 0;
 
 extern int optind;
 
+/* Long options without short form */
+#define OPT_SYMMETRIC 0x100
+#define OPT_TILE_ROWS 0x101
+#define OPT_TILE_MEM  0x102
+#define OPT_TASK      0x103
+#define OPT_PIN       0x104
+#define OPT_PREFETCH  0x105
+#define OPT_MEM_LIMIT 0x106
+#define OPT_MAP_CACHE 0x107
+#define OPT_PACK      0x108
+#define OPT_INCLUDE   0x109
+#define OPT_EXCLUDE   0x10a
+#define OPT_MIN_SIZE  0x10b
+#define OPT_MAX_SIZE  0x10c
+#define OPT_FILES_FROM 0x10d
+#define OPT_QUERY     0x10e
+#define OPT_QUERY_FROM 0x10f
+#define OPT_TAR       0x110
+
 /* Prototypes */
 void show_help(char *prgname);
 void show_version(char *prgname);
@@ -35,31 +54,69 @@ int main(int argc, char **argv)
 	static struct option longOpts[] = {
 		{"compressor",     required_argument, NULL, 'c'},
 		{"directory-mode", required_argument, NULL, 'd'},
+		{"exclude",        required_argument, NULL, OPT_EXCLUDE},
+		{"files-from",     required_argument, NULL, OPT_FILES_FROM},
 		{"help",           no_argument,       NULL, 'h'},
+		{"include",        required_argument, NULL, OPT_INCLUDE},
 		{"list",           no_argument,       NULL, 'L'},
+		{"map-cache",      required_argument, NULL, OPT_MAP_CACHE},
+		{"max-size",       required_argument, NULL, OPT_MAX_SIZE},
+		{"mem-limit",      required_argument, NULL, OPT_MEM_LIMIT},
+		{"min-size",       required_argument, NULL, OPT_MIN_SIZE},
 		{"output",         required_argument, NULL, 'o'},
+		{"pack",           required_argument, NULL, OPT_PACK},
+		{"pin",            no_argument,       NULL, OPT_PIN},
+		{"prefetch",       optional_argument, NULL, OPT_PREFETCH},
+		{"query",          required_argument, NULL, OPT_QUERY},
+		{"query-from",     required_argument, NULL, OPT_QUERY_FROM},
+		{"recursive",      no_argument,       NULL, 'r'},
 		{"size",           no_argument,		  NULL, 's'},
+		{"symmetric",      optional_argument, NULL, OPT_SYMMETRIC},
+		{"tar",            required_argument, NULL, OPT_TAR},
+		{"task",           required_argument, NULL, OPT_TASK},
 		{"threads",        required_argument, NULL, 't'},
+		{"tile-rows",      required_argument, NULL, OPT_TILE_ROWS},
+		{"tile-mem",       required_argument, NULL, OPT_TILE_MEM},
 		{"verbose",        no_argument,		  NULL, 'v'},
 		{"version",        no_argument,		  NULL, 'V'},
 		{NULL, no_argument, NULL, 0}
 	};
-	const char *optstring = "c:d:hLo:st:vV";
+	const char *optstring = "c:d:hLo:rst:vV";
 	int opt, optli, n_args;
 	char optc;
-	char mode, *output, *compressor, *inpdir;
-	char *input[2], csize;
-	int n_threads;
+	char *output, *inpdir;
+	char *input[2];
+	ncd_opts_t opts;
 
 	/* Default values */
-	input[0]   = NULL;
-	input[1]   = NULL;
-	inpdir     = NULL;
-	mode       = NCD_FILEMODE;
-	output     = DEFAULT_OUTPUT;
-	n_threads  = DEFAULT_THREADS;
-	compressor = DEFAULT_COMPRESSOR;
-	csize      = 0;
+	input[0]        = NULL;
+	input[1]        = NULL;
+	inpdir          = NULL;
+	output          = DEFAULT_OUTPUT;
+	opts.mode       = NCD_FILEMODE;
+	opts.n_threads  = DEFAULT_THREADS;
+	opts.compressor = DEFAULT_COMPRESSOR;
+	opts.csize      = 0;
+	opts.symmetric  = NCD_SYM_NONE;
+	opts.tile_rows  = DEFAULT_TILE_ROWS;
+	opts.tile_mem   = (size_t)DEFAULT_TILE_MEM << 20;
+	opts.task       = NCD_TASK_ROW;
+	opts.verbose    = 0;
+	opts.pin        = 0;
+	opts.prefetch   = 0;
+	opts.mem_limit  = 0;
+	opts.map_cache  = (size_t)DEFAULT_MAP_CACHE << 20;
+	opts.pack_mem   = (size_t)DEFAULT_PACK_MEM << 20;
+	opts.recursive  = 0;
+	opts.include    = NULL;
+	opts.n_include  = 0;
+	opts.exclude    = NULL;
+	opts.n_exclude  = 0;
+	opts.min_size   = 0;
+	opts.max_size   = 0;
+	opts.query      = NULL;
+	opts.query_mode = NCD_DIRMODE;
+	opts.queries    = 0;
 
 	/* Treat command line */
 	optc  = 0x00; 
@@ -67,15 +124,35 @@ int main(int argc, char **argv)
 	while(opt != -1) {
 		switch(opt) {
 			case 'c':
-				compressor = strdup(optarg);
+				opts.compressor = strdup(optarg);
 				break;
 
 			case 'd':
-				optc   |= ARG_DIRMODE;
-				mode    = NCD_DIRMODE;
-				inpdir  = strdup(optarg);
+				optc     |= ARG_DIRMODE;
+				opts.mode = NCD_DIRMODE;
+				inpdir    = strdup(optarg);
 				break;
 	
+			case OPT_FILES_FROM:
+				opts.mode = NCD_LISTMODE;
+				inpdir    = strdup(optarg);
+				break;
+
+			case OPT_TAR:
+				opts.mode = NCD_TARMODE;
+				inpdir    = strdup(optarg);
+				break;
+
+			case OPT_QUERY:
+				opts.query      = strdup(optarg);
+				opts.query_mode = NCD_DIRMODE;
+				break;
+
+			case OPT_QUERY_FROM:
+				opts.query      = strdup(optarg);
+				opts.query_mode = NCD_LISTMODE;
+				break;
+
 			case 'L':
 				optc |= ARG_LIST;
 				break;
@@ -84,17 +161,144 @@ int main(int argc, char **argv)
 				output = strdup(optarg);
 				break;
 
+			case 'r':
+				opts.recursive = 1;
+				break;
+
+			case OPT_INCLUDE:
+				opts.include = (char**)realloc(opts.include, sizeof(char*) * (opts.n_include + 1));
+				if (opts.include == NULL) {
+					perror("main()");
+					return (EXIT_FAILURE);
+				}
+				opts.include[opts.n_include++] = optarg;
+				break;
+
+			case OPT_EXCLUDE:
+				opts.exclude = (char**)realloc(opts.exclude, sizeof(char*) * (opts.n_exclude + 1));
+				if (opts.exclude == NULL) {
+					perror("main()");
+					return (EXIT_FAILURE);
+				}
+				opts.exclude[opts.n_exclude++] = optarg;
+				break;
+
+			case OPT_MIN_SIZE:
+				if (atol(optarg) < 0) {
+					fprintf(stderr, "Invalid minimum size: %s (should be 0 or greater)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.min_size = (size_t)atol(optarg);
+				break;
+
+			case OPT_MAX_SIZE:
+				if (atol(optarg) <= 0) {
+					fprintf(stderr, "Invalid maximum size: %s (should be greater then 0)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.max_size = (size_t)atol(optarg);
+				break;
+
 			case 's':
-				optc |= ARG_SIZE;
-				csize = 1;
+				optc      |= ARG_SIZE;
+				opts.csize = 1;
+				break;
+
+			case OPT_MAP_CACHE:
+				if (atol(optarg) < 0) {
+					fprintf(stderr, "Invalid mapping cache size: %s (should be 0 or greater)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.map_cache = (size_t)atol(optarg) << 20;
+				break;
+
+			case OPT_MEM_LIMIT:
+				if (atol(optarg) <= 0) {
+					fprintf(stderr, "Invalid memory limit: %s (should be greater then 0)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.mem_limit = (size_t)atol(optarg) << 20;
+				break;
+
+			case OPT_PACK:
+				if (atol(optarg) < 0) {
+					fprintf(stderr, "Invalid arena size: %s (should be 0 or greater)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.pack_mem = (size_t)atol(optarg) << 20;
+				break;
+
+			case OPT_PIN:
+				opts.pin = 1;
+				break;
+
+			case OPT_PREFETCH:
+				if (optarg == NULL) {
+					opts.prefetch = NCD_PREFETCH_AUTO;
+				} else if (atol(optarg) <= 0) {
+					fprintf(stderr, "Invalid number of tasks to prefetch: %s (should be greater then 0)\n", optarg);
+					return (EXIT_FAILURE);
+				} else {
+					opts.prefetch = atol(optarg);
+				}
+				break;
+
+			case OPT_SYMMETRIC:
+				if (optarg == NULL || strcmp(optarg, "ab") == 0) {
+					opts.symmetric = NCD_SYM_AB;
+				} else if (strcmp(optarg, "min") == 0) {
+					opts.symmetric = NCD_SYM_MIN;
+				} else if (strcmp(optarg, "avg") == 0) {
+					opts.symmetric = NCD_SYM_AVG;
+				} else {
+					fprintf(stderr, "Invalid symmetric policy: %s (should be ab, min or avg)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				break;
+
+			case OPT_TASK:
+				if (strcmp(optarg, "row") == 0) {
+					opts.task = NCD_TASK_ROW;
+				} else if (strcmp(optarg, "tile") == 0) {
+					opts.task = NCD_TASK_TILE;
+				} else if (strcmp(optarg, "pair") == 0) {
+					opts.task = NCD_TASK_PAIR;
+				} else {
+					fprintf(stderr, "Invalid task granularity: %s (should be row, tile or pair)\n", optarg);
+					return (EXIT_FAILURE);
+				}
 				break;
 
 			case 't':
-				n_threads = atoi(optarg);
+				if (strcmp(optarg, "auto") == 0) {
+					opts.n_threads = 0;
+				} else if (atoi(optarg) <= 0) {
+					fprintf(stderr, "Invalid number of threads: %s (should be auto or greater then 0)\n", optarg);
+					return (EXIT_FAILURE);
+				} else {
+					opts.n_threads = atoi(optarg);
+				}
+				break;
+
+			case OPT_TILE_ROWS:
+				if (atol(optarg) <= 0) {
+					fprintf(stderr, "Invalid number of tile lines: %s (should be greater then 0)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.tile_rows = atol(optarg);
+				break;
+
+			case OPT_TILE_MEM:
+				if (atol(optarg) <= 0) {
+					fprintf(stderr, "Invalid tile memory: %s (should be greater then 0)\n", optarg);
+					return (EXIT_FAILURE);
+				}
+				opts.tile_mem = (size_t)atol(optarg) << 20;
 				break;
 
 			case 'v':
 				optc |= ARG_VERBOSE;
+				opts.verbose = 1;
 				break;
 
 			case 'V':
@@ -123,32 +327,39 @@ int main(int argc, char **argv)
 		return (EXIT_SUCCESS);
 	}
 
-	/* Validate parameters */
-	if (n_threads <= 0) {
-		fprintf(stderr, "Invalid number of threads: %d (should be greater then 0)\n", n_threads);
-		return (EXIT_FAILURE);
-	}
-
 	/* Read input arguments */
-	if ((optind+1) > argc && mode != NCD_DIRMODE) {
+	if ((optind+1) > argc && opts.mode == NCD_FILEMODE) {
 		show_help(argv[0]);
 		return (EXIT_FAILURE);
 	}
 
 	n_args = (argc - optind);
-	if (mode == NCD_FILEMODE && n_args < 2 && csize == 0) {
+	if (opts.mode == NCD_FILEMODE && n_args < 2 && opts.csize == 0) {
 		/* One or less inputs is not valid in NCD file mode */
 		fprintf(stderr, "Two files should be passed in file mode.\n");
 		return (EXIT_FAILURE);
-	} else if (mode == NCD_DIRMODE) {
-		/* In directory mode, no other inputs should be allowed */
+	} else if (opts.query != NULL && opts.mode == NCD_FILEMODE) {
+		fprintf(stderr, "Query files should be compared to a directory (-d), file list or archive.\n");
+		return (EXIT_FAILURE);
+	} else if (opts.query != NULL && opts.symmetric != NCD_SYM_NONE) {
+		fprintf(stderr, "Rectangular (query) matrix can't be symmetric.\n");
+		return (EXIT_FAILURE);
+	} else if (opts.query_mode == NCD_LISTMODE && opts.mode == NCD_LISTMODE &&
+			strcmp(opts.query, "-") == 0 && strcmp(inpdir, "-") == 0) {
+		fprintf(stderr, "Only one file list can be read from stdin.\n");
+		return (EXIT_FAILURE);
+	} else if (opts.mode != NCD_DIRMODE && opts.recursive) {
+		fprintf(stderr, "Recursive mode should be used with directory mode (-d).\n");
+		return (EXIT_FAILURE);
+	} else if (opts.mode == NCD_DIRMODE || opts.mode == NCD_LISTMODE || opts.mode == NCD_TARMODE) {
+		/* In directory (list or archive) mode, no other inputs should be allowed */
 		if (n_args > 0) {
-			fprintf(stderr, "Only one directory should be passed in directory mode.\n");
+			fprintf(stderr, "Only one directory, file list or archive should be passed.\n");
 			return (EXIT_FAILURE);
 		}
 		input[0] = inpdir;
 	} else {
-		if (csize == 1) {
+		if (opts.csize == 1) {
 			input[0] = argv[argc-1];
 		} else { 
 			input[0] = argv[argc-2];
@@ -157,8 +368,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Calculate NCD */
-	if (do_ncd(input[0], input[1], output, 
-				compressor, mode, csize, n_threads) < 0) {
+	if (do_ncd(input[0], input[1], output, &opts) < 0) {
 		fprintf(stderr, "Error. NCD cannot be calculated.\n");
 	}
 
@@ -178,11 +388,53 @@ void show_help(char *prgname)
 	printf("OPTIONS:\n");
 	printf("    -c, --compressor=COMPNAME   set compressor to use\n");
 	printf("    -d, --directory-mode        directory of files\n");
+	printf("        --exclude=GLOB          skip files and directories whose names match\n");
+	printf("                                GLOB (can be repeated)\n");
+	printf("        --files-from=PATH|-     read the files from PATH (or stdin), one per\n");
+	printf("                                line or null terminated, optionally as\n");
+	printf("                                SIZE<tab>PATH to skip their stat\n");
 	printf("    -h, --help                  print this help message\n");
+	printf("        --include=GLOB          only files whose names match GLOB (can be\n");
+	printf("                                repeated)\n");
 	printf("    -L, --list                  list compressors\n");
+	printf("        --map-cache=MB          keep up to MB of unused files mapped, least\n");
+	printf("                                recently used are unmapped first (default:\n");
+	printf("                                %d MB, 0 to disable)\n", DEFAULT_MAP_CACHE);
+	printf("        --max-size=BYTES        skip files larger than BYTES\n");
+	printf("        --mem-limit=MB          delay tasks while mapped files and compressor\n");
+	printf("                                states would exceed MB (default: no limit)\n");
+	printf("        --min-size=BYTES        skip files smaller than BYTES\n");
 	printf("    -o, --output=FILEOUT        use FILEOUT instead of distmatrix\n");
+	printf("        --pack=MB               read small files (up to %d KB) once into a\n", NCD_SMALL_FILE >> 10);
+	printf("                                single arena of up to MB (default: %d MB, 0\n", DEFAULT_PACK_MEM);
+	printf("                                to disable)\n");
+	printf("        --pin                   pin threads to CPUs, spreading them (and the\n");
+	printf("                                matrix lines) over NUMA nodes\n");
+	printf("        --prefetch[=TASKS]      read files of the tasks TASKS ahead (default:\n");
+	printf("                                number of threads) in background, and drop\n");
+	printf("                                files from page cache after their last use\n");
+	printf("        --query=DIR             compute only the rectangular matrix of the\n");
+	printf("                                files of DIR (lines) against the files of the\n");
+	printf("                                directory or list (columns)\n");
+	printf("        --query-from=PATH|-     as --query, with files read from PATH (see\n");
+	printf("                                --files-from)\n");
+	printf("    -r, --recursive             walk subdirectories in directory mode (files\n");
+	printf("                                are labeled by their path from it)\n");
 	printf("    -s, --size                  just compressed sizes in bits no NCD\n");
-	printf("    -t, --threads               maximum number of threads\n");
+	printf("        --symmetric[=POLICY]    symmetric matrix, POLICY is one of: ab (default,\n");
+	printf("                                only C(AB) for A before B), min or avg (of C(AB)\n");
+	printf("                                and C(BA))\n");
+	printf("        --tar=ARCHIVE           files are the members of the uncompressed tar\n");
+	printf("                                ARCHIVE, mapped without extraction (labeled\n");
+	printf("                                by their member names)\n");
+	printf("        --task=GRANULARITY      work unit taken by each thread: row (default,\n");
+	printf("                                tile-rows lines), tile (tile-rows lines by one\n");
+	printf("                                column block) or pair (single matrix cell)\n");
+	printf("    -t, --threads=N|auto        maximum number of threads (default: auto, from\n");
+	printf("                                CPU affinity, cgroup CPU quota and memory)\n");
+	printf("        --tile-rows=N           number of matrix lines per tile (default: %d)\n", DEFAULT_TILE_ROWS);
+	printf("        --tile-mem=MB           size of the files of each tile column block\n");
+	printf("                                (default: %d MB)\n", DEFAULT_TILE_MEM);
 	printf("    -v, --verbose               print extra detailed information\n");
 	printf("    -V, --version               print program's version and exit\n");
 }
@@ -19,11 +19,24 @@
 
 #include <stdlib.h>
 #include <semaphore.h>
+#include <time.h>
 #include "config.h"
 
 #define DEFAULT_OUTPUT     "distmatrix.txt"
-#define DEFAULT_THREADS    2
+#define DEFAULT_THREADS    0   /* auto */
 #define DEFAULT_COMPRESSOR "ppmd"
+#define DEFAULT_TILE_ROWS  4
+#define DEFAULT_TILE_MEM   64  /* MB */
+#define DEFAULT_MAP_CACHE  256 /* MB */
+#define DEFAULT_PACK_MEM   512 /* MB */
+
+/** Files up to this size are read into memory instead of mapped */
+#define NCD_SMALL_FILE (64 * 1024)
+/** Maximum number of small files loaded at once (see ncd_load()) */
+#define NCD_LOAD_BATCH 64
+
+/** Maximum number of columns in a tile */
+#define NCD_TILE_COLS      4096
 
 #define ARG_HELP    0x01
 #define ARG_DIRMODE 0x02
@@ -36,23 +49,129 @@
 
 #define NCD_FILEMODE 0x01
 #define NCD_DIRMODE  0x02
+#define NCD_LISTMODE 0x04
+#define NCD_TARMODE  0x08
+
+/* Task granularity */
+#define NCD_TASK_ROW  0x00
+#define NCD_TASK_TILE 0x01
+#define NCD_TASK_PAIR 0x02
+
+/* Prefetch as many tasks ahead as threads */
+#define NCD_PREFETCH_AUTO ((unsigned long)-1)
+
+/* File advices (see ncd_advise()) */
+#define NCD_DONTNEED 0
+#define NCD_WILLNEED 1
+
+/* Files kept in memory for the whole run (see file_t.packed) */
+#define NCD_PACKED_ARENA 1
+#define NCD_PACKED_TAR   2
+
+/* Symmetric matrix policies */
+#define NCD_SYM_NONE 0x00
+#define NCD_SYM_AB   0x01
+#define NCD_SYM_MIN  0x02
+#define NCD_SYM_AVG  0x03
+
+/** NCD options */
+typedef struct _ncd_opts_t {
+	/** Compressor name */
+	char *compressor;
+	/** NCD mode (file, directory, list or tar) */
+	char mode;
+	/** Should be 1 to return only compressed size of the files */
+	char csize;
+	/** Maximum number of threads */
+	int n_threads;
+	/** Symmetric matrix policy (NCD_SYM_*) */
+	char symmetric;
+	/** Number of matrix lines of each tile */
+	unsigned long tile_rows;
+	/** Maximum size (in bytes) of the files of each tile column block */
+	size_t tile_mem;
+	/** Task granularity (NCD_TASK_*) */
+	char task;
+	/** Verbose output (on stderr) */
+	char verbose;
+	/** Pin threads to CPUs (and split work among NUMA nodes) */
+	char pin;
+	/** Number of tasks to look ahead for prefetching files (0 = disabled) */
+	unsigned long prefetch;
+	/** Memory budget for mapped files and compressor states (0 = unlimited) */
+	size_t mem_limit;
+	/** Walk subdirectories (directory mode) */
+	char recursive;
+	/** Only files whose names match any of these globs (if any) */
+	char **include;
+	int n_include;
+	/** Skip files and directories whose names match any of these globs */
+	char **exclude;
+	int n_exclude;
+	/** Size limits of the files (max_size = 0 for no limit) */
+	size_t min_size, max_size;
+	/** Query files (directory or list) for rectangular mode (NULL = square) */
+	char *query;
+	/** How query files are given (NCD_DIRMODE or NCD_LISTMODE) */
+	char query_mode;
+	/** Number of query files: first lines of the matrix (0 = square) */
+	unsigned long queries;
+	/** Size of unused files kept mapped (0 = disabled) */
+	size_t map_cache;
+	/** Maximum size of the arena of small files (0 = disabled) */
+	size_t pack_mem;
+} ncd_opts_t;
+
+/** Matrix task: tile of nr lines by nc columns */
+typedef struct _ncd_task_t {
+	/** First line */
+	unsigned long r0;
+	/** Number of lines */
+	unsigned long nr;
+	/** First column */
+	unsigned long c0;
+	/** Number of columns */
+	unsigned long nc;
+	/** Estimated cost (bytes to compress) */
+	size_t cost;
+} ncd_task_t;
+
+/** Job run by a borrowed thread (see sched_lend()) */
+typedef struct _sched_job_t {
+	/** Function to run and its argument */
+	void *(*fn)(void*);
+	void *arg;
+	/** Set when the job is done */
+	int done;
+	/** Next job on the queue */
+	struct _sched_job_t *next;
+} sched_job_t;
 
 /** Single file structure */
 typedef struct _file_t {
 	/** File path */
 	char *path;
+	/** Label on the matrix (NULL for the base name of the path) */
+	char *label;
 	/** File descriptor */
 	int fd;
 	/** File error */
 	int f_errors;
 	/** File size */
 	ssize_t fsize;
-	/** Compressed size */
-	ssize_t compsize;
 	/** File contents */
 	unsigned char *contents;
 	/** Reference counter */
 	ssize_t reference;
+	/** Contents were read into memory (instead of mapped) */
+	char heap;
+	/** Contents stay in memory for the whole run: arena of small files or
+	 * mapped tar archive (NCD_PACKED_*, 0 otherwise) */
+	char packed;
+	/** Unused contents kept in the mapping cache (see ncd_close()) */
+	char cached;
+	/** Neighbours on the mapping cache (most recently used first) */
+	struct _file_t *lru_prev, *lru_next;
 	/** Semaphore to atomic access */
 	sem_t lock;
 } file_t;
@@ -71,6 +190,14 @@ typedef struct _compressor {
 	char *name;
 	/** Function to give compressed file size */
 	ssize_t (*get_compressed_size)(ncd_file_t*);
+	/** Prime compressor state with file A (optional, NULL if not supported) */
+	void *(*prefix_open)(ncd_file_t*);
+	/** Function to give compressed size of AB reusing the primed state of A */
+	ssize_t (*prefix_getcompsize)(void*, ncd_file_t*);
+	/** Release primed state */
+	void (*prefix_close)(void*);
+	/** Memory used by each thread (compressor states), in bytes */
+	size_t ctxmem;
 } compressor_t;
 
 /** Type of each matrix element */
@@ -85,14 +212,51 @@ extern int ncd_err;
 /* Prototypes */
 mat_t **new_mat(unsigned long i, unsigned long j);
 void destroy_mat(mat_t ***m, int i);
-int	do_ncd(char *inputA, char *inputB, char *output, char *compressor, char mode, char csize, int n_threads);
+int	do_ncd(char *inputA, char *inputB, char *output, ncd_opts_t *opts);
 void list_compressors(void);
+char *get_fullpath(char *basedir, char *filename);
+long scan_dir(char *dir, file_t **files, ncd_opts_t *opts, int n_threads);
+long scan_list(char *manifest, file_t **files, ncd_opts_t *opts, int n_threads);
+long scan_tar(char *path, file_t **files, ncd_opts_t *opts);
+void ncd_tar_free(void);
+void ncd_file_init(file_t *file, char *path, ssize_t fsize);
 ncd_file_t *ncd_open(file_t *fileA, file_t *fileB);
 void ncd_close(ncd_file_t *fp);
 ssize_t ncd_fread(void *ptr, size_t size, size_t nmemb, ncd_file_t *stream);
+ssize_t ncd_fsegment(ncd_file_t *stream, const unsigned char **ptr, size_t maxlen);
 int ncd_getc(ncd_file_t *stream);
 int ncd_putc(int c, ncd_file_t *stream);
 int ncd_ferror(ncd_file_t *stream);
 int ncd_feof(ncd_file_t *stream);
+int ncd_fseek(ncd_file_t *stream, long offset, int whence);
+int ncd_advise(file_t *file, int advice);
+void ncd_cache_init(size_t bytes);
+void ncd_cache_free(void);
+unsigned long ncd_pack(file_t *files, unsigned long n, int n_threads, size_t bytes);
+void ncd_pack_free(void);
+int ncd_load(file_t **files, unsigned long n);
+long sched_init(ncd_opts_t *opts, int n_threads, size_t ctxmem);
+int sched_next_file(ncd_task_t *task, int node);
+int sched_next_files(ncd_task_t *tasks, int max, int node);
+int sched_next(ncd_task_t *task, int node);
+int sched_peek(ncd_task_t *task, int node, unsigned long ahead);
+void sched_done(ncd_task_t *task, struct timespec *start, int node);
+double sched_throughput(int node);
+void sched_idle(int n);
+int sched_borrow(int max);
+void sched_giveback(int n);
+void sched_lend(sched_job_t *job, void *(*fn)(void*), void *arg);
+void sched_join(sched_job_t *job);
+void sched_help(void);
+void sched_reserve(size_t bytes);
+void sched_release(size_t bytes);
+void sched_free(void);
+int topo_init(int n_threads, char pin);
+int topo_bind(int tid);
+int topo_node(int tid);
+int topo_cpu(int tid);
+int topo_nodes(void);
+int topo_threads(size_t ctxmem, char verbose);
+void topo_free(void);
 
 #endif /* NCD_H */
@@ -114,6 +114,7 @@ typedef int Bool;
 
 #define MY_CDECL __cdecl
 #define MY_FAST_CALL __fastcall
+#define MY_FORCE_INLINE __forceinline
 
 #else
 
@@ -121,6 +122,12 @@ typedef int Bool;
 #define MY_CDECL
 #define MY_FAST_CALL
 
+#if defined(__GNUC__)
+#define MY_FORCE_INLINE __inline__ __attribute__((always_inline))
+#else
+#define MY_FORCE_INLINE
+#endif
+
 #endif
 
 
@@ -5,6 +5,8 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 #include <stdlib.h>
 
@@ -124,6 +126,32 @@ void BigFree(void *address)
   VirtualFree(address, 0, MEM_RELEASE);
 }
 
+#elif defined(__linux__)
+
+/* Big blocks are aligned to huge pages and marked as eligible for
+   transparent huge pages (whenever the kernel supports it) */
+#define BIG_ALLOC_ALIGN (1 << 21)
+
+void *BigAlloc(size_t size)
+{
+  void *p;
+  if (size == 0)
+    return 0;
+  if (size < BIG_ALLOC_ALIGN)
+    return MyAlloc(size);
+  if (posix_memalign(&p, BIG_ALLOC_ALIGN, size) != 0)
+    return 0;
+  #ifdef MADV_HUGEPAGE
+  madvise(p, size, MADV_HUGEPAGE);
+  #endif
+  return p;
+}
+
+void BigFree(void *address)
+{
+  free(address);
+}
+
 #endif
 
 
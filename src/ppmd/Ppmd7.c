@@ -340,6 +340,54 @@ void Ppmd7_Init(CPpmd7 *p, unsigned maxOrder)
   p->DummySee.Count = 64; /* unused */
 }
 
+void Ppmd7_Snapshot_Construct(CPpmd7_Snapshot *s)
+{
+  s->Buf = 0;
+  s->BufSize = 0;
+  s->TextSize = s->UnitsSize = s->CtxSize = 0;
+}
+
+void Ppmd7_Snapshot_Free(CPpmd7_Snapshot *s, ISzAlloc *alloc)
+{
+  alloc->Free(alloc, s->Buf);
+  Ppmd7_Snapshot_Construct(s);
+}
+
+Bool Ppmd7_Snapshot_Save(CPpmd7_Snapshot *s, const CPpmd7 *p, ISzAlloc *alloc)
+{
+  Byte *end = p->Base + p->AlignOffset + p->Size;
+  UInt32 textSize = (UInt32)(p->Text - p->Base);
+  UInt32 unitsSize = (UInt32)(p->LoUnit - p->UnitsStart);
+  UInt32 ctxSize = (UInt32)(end - p->HiUnit);
+  UInt32 size = textSize + unitsSize + ctxSize;
+
+  if (s->Buf == 0 || s->BufSize < size)
+  {
+    alloc->Free(alloc, s->Buf);
+    s->BufSize = 0;
+    if ((s->Buf = (Byte *)alloc->Alloc(alloc, size)) == 0)
+      return False;
+    s->BufSize = size;
+  }
+
+  s->Model = *p;
+  s->TextSize = textSize;
+  s->UnitsSize = unitsSize;
+  s->CtxSize = ctxSize;
+  memcpy(s->Buf, p->Base, textSize);
+  memcpy(s->Buf + textSize, p->UnitsStart, unitsSize);
+  memcpy(s->Buf + textSize + unitsSize, p->HiUnit, ctxSize);
+  return True;
+}
+
+void Ppmd7_Snapshot_Restore(const CPpmd7_Snapshot *s, CPpmd7 *p)
+{
+  *p = s->Model;
+  memcpy(p->Base, s->Buf, s->TextSize);
+  memcpy(p->UnitsStart, s->Buf + s->TextSize, s->UnitsSize);
+  memcpy(p->HiUnit, s->Buf + s->TextSize + s->UnitsSize, s->CtxSize);
+}
+
 static CTX_PTR CreateSuccessors(CPpmd7 *p, Bool skip)
 {
   CPpmd_State upState;
@@ -65,6 +65,24 @@ void Ppmd7_Free(CPpmd7 *p, ISzAlloc *alloc);
 void Ppmd7_Init(CPpmd7 *p, unsigned maxOrder);
 #define Ppmd7_WasAllocated(p) ((p)->Base != NULL)
 
+/* ---------- Snapshot ----------
+Saves the model state (the CPpmd7 structure plus the live areas of Base:
+text area, allocated units and contexts), so the same model can be rolled
+back to that point later. Restore must be done on the same CPpmd7 used on Save. */
+
+typedef struct
+{
+  CPpmd7 Model;
+  Byte *Buf;
+  UInt32 BufSize;
+  UInt32 TextSize, UnitsSize, CtxSize;
+} CPpmd7_Snapshot;
+
+void Ppmd7_Snapshot_Construct(CPpmd7_Snapshot *s);
+Bool Ppmd7_Snapshot_Save(CPpmd7_Snapshot *s, const CPpmd7 *p, ISzAlloc *alloc);
+void Ppmd7_Snapshot_Restore(const CPpmd7_Snapshot *s, CPpmd7 *p);
+void Ppmd7_Snapshot_Free(CPpmd7_Snapshot *s, ISzAlloc *alloc);
+
 
 /* ---------- Internal Functions ---------- */
 
@@ -110,6 +128,20 @@ void Ppmd7z_RangeEnc_FlushData(CPpmd7z_RangeEnc *p);
 
 void Ppmd7_EncodeSymbol(CPpmd7 *p, CPpmd7z_RangeEnc *rc, int symbol);
 
+/* ---------- Size counting encoder ---------- */
+
+/* Same coding as the 7z range encoder, but it only counts the output bytes */
+typedef struct
+{
+  UInt32 Range;
+  UInt64 Size;
+} CPpmd7z_RangeCnt;
+
+void Ppmd7z_RangeCnt_Init(CPpmd7z_RangeCnt *p);
+void Ppmd7z_RangeCnt_FlushData(CPpmd7z_RangeCnt *p);
+
+void Ppmd7_CountBuffer(CPpmd7 *p, CPpmd7z_RangeCnt *rc, const Byte *data, size_t size);
+
 EXTERN_C_END
  
 #endif
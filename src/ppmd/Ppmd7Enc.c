@@ -185,3 +185,171 @@ void Ppmd7_EncodeSymbol(CPpmd7 *p, CPpmd7z_RangeEnc *rc, int symbol)
     see->Summ = (UInt16)(see->Summ + sum + escFreq);
   }
 }
+
+
+/* Size counting range encoder.
+It follows the coding of the 7z range encoder, where each normalization shift
+makes exactly one byte to be written (now or later, when the cache is
+released). Normalization depends only on Range, so the output size is the
+number of shifts and neither Low nor the cache need to be tracked. */
+
+void Ppmd7z_RangeCnt_Init(CPpmd7z_RangeCnt *p)
+{
+  p->Range = 0xFFFFFFFF;
+  p->Size = 0;
+}
+
+static void RangeCnt_Encode(CPpmd7z_RangeCnt *p, UInt32 start, UInt32 size, UInt32 total)
+{
+  UNUSED_VAR(start)
+  p->Range = (p->Range / total) * size;
+  while (p->Range < kTopValue)
+  {
+    p->Range <<= 8;
+    p->Size++;
+  }
+}
+
+static void RangeCnt_EncodeBit_0(CPpmd7z_RangeCnt *p, UInt32 size0)
+{
+  p->Range = (p->Range >> 14) * size0;
+  while (p->Range < kTopValue)
+  {
+    p->Range <<= 8;
+    p->Size++;
+  }
+}
+
+static void RangeCnt_EncodeBit_1(CPpmd7z_RangeCnt *p, UInt32 size0)
+{
+  p->Range -= (p->Range >> 14) * size0;
+  while (p->Range < kTopValue)
+  {
+    p->Range <<= 8;
+    p->Size++;
+  }
+}
+
+void Ppmd7z_RangeCnt_FlushData(CPpmd7z_RangeCnt *p)
+{
+  p->Size += 5;
+}
+
+
+/* Ppmd7_EncodeSymbol() with the size counting encoder */
+static MY_FORCE_INLINE void CountSymbol(CPpmd7 *p, CPpmd7z_RangeCnt *rc, int symbol)
+{
+  size_t charMask[256 / sizeof(size_t)];
+  if (p->MinContext->NumStats != 1)
+  {
+    CPpmd_State *s = Ppmd7_GetStats(p, p->MinContext);
+    UInt32 sum;
+    unsigned i;
+    if (s->Symbol == symbol)
+    {
+      RangeCnt_Encode(rc, 0, s->Freq, p->MinContext->SummFreq);
+      p->FoundState = s;
+      Ppmd7_Update1_0(p);
+      return;
+    }
+    p->PrevSuccess = 0;
+    sum = s->Freq;
+    i = p->MinContext->NumStats - 1;
+    do
+    {
+      if ((++s)->Symbol == symbol)
+      {
+        RangeCnt_Encode(rc, sum, s->Freq, p->MinContext->SummFreq);
+        p->FoundState = s;
+        Ppmd7_Update1(p);
+        return;
+      }
+      sum += s->Freq;
+    }
+    while (--i);
+    
+    p->HiBitsFlag = p->HB2Flag[p->FoundState->Symbol];
+    PPMD_SetAllBitsIn256Bytes(charMask);
+    MASK(s->Symbol) = 0;
+    i = p->MinContext->NumStats - 1;
+    do { MASK((--s)->Symbol) = 0; } while (--i);
+    RangeCnt_Encode(rc, sum, p->MinContext->SummFreq - sum, p->MinContext->SummFreq);
+  }
+  else
+  {
+    UInt16 *prob = Ppmd7_GetBinSumm(p);
+    CPpmd_State *s = Ppmd7Context_OneState(p->MinContext);
+    if (s->Symbol == symbol)
+    {
+      RangeCnt_EncodeBit_0(rc, *prob);
+      *prob = (UInt16)PPMD_UPDATE_PROB_0(*prob);
+      p->FoundState = s;
+      Ppmd7_UpdateBin(p);
+      return;
+    }
+    else
+    {
+      RangeCnt_EncodeBit_1(rc, *prob);
+      *prob = (UInt16)PPMD_UPDATE_PROB_1(*prob);
+      p->InitEsc = PPMD7_kExpEscape[*prob >> 10];
+      PPMD_SetAllBitsIn256Bytes(charMask);
+      MASK(s->Symbol) = 0;
+      p->PrevSuccess = 0;
+    }
+  }
+  for (;;)
+  {
+    UInt32 escFreq;
+    CPpmd_See *see;
+    CPpmd_State *s;
+    UInt32 sum;
+    unsigned i, numMasked = p->MinContext->NumStats;
+    do
+    {
+      p->OrderFall++;
+      if (!p->MinContext->Suffix)
+        return; /* EndMarker (symbol = -1) */
+      p->MinContext = Ppmd7_GetContext(p, p->MinContext->Suffix);
+    }
+    while (p->MinContext->NumStats == numMasked);
+    
+    see = Ppmd7_MakeEscFreq(p, numMasked, &escFreq);
+    s = Ppmd7_GetStats(p, p->MinContext);
+    sum = 0;
+    i = p->MinContext->NumStats;
+    do
+    {
+      int cur = s->Symbol;
+      if (cur == symbol)
+      {
+        UInt32 low = sum;
+        CPpmd_State *s1 = s;
+        do
+        {
+          sum += (s->Freq & (int)(MASK(s->Symbol)));
+          s++;
+        }
+        while (--i);
+        RangeCnt_Encode(rc, low, s1->Freq, sum + escFreq);
+        Ppmd_See_Update(see);
+        p->FoundState = s1;
+        Ppmd7_Update2(p);
+        return;
+      }
+      sum += (s->Freq & (int)(MASK(cur)));
+      MASK(cur) = 0;
+      s++;
+    }
+    while (--i);
+    
+    RangeCnt_Encode(rc, sum, escFreq, sum + escFreq);
+    see->Summ = (UInt16)(see->Summ + sum + escFreq);
+  }
+}
+
+void Ppmd7_CountBuffer(CPpmd7 *p, CPpmd7z_RangeCnt *rc, const Byte *data, size_t size)
+{
+  const Byte *end = data + size;
+  for (; data != end; data++)
+    CountSymbol(p, rc, *data);
+}
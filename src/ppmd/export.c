@@ -1,64 +1,167 @@
+#include <pthread.h>
 #include "export.h"
 #include "Alloc.h"
 #include "Ppmd7.h"
 #include <ncd.h>
 
-typedef struct {
-  IByteOut i;
-  ssize_t size;
-} BufferOutStream;
+#define PPMD_ORDER  9
+#define PPMD_DICMEM (10 * 1024 * 1024)
 
-static size_t written(BufferOutStream *os) {
-  return os->size;
-}
+/* Each thread keeps its own model memory for the entire run, it's just
+ * initialized again on each compression */
+static pthread_key_t handleKey;
+static pthread_once_t handleKeyOnce = PTHREAD_ONCE_INIT;
 
-static void write(void *p, Byte b) {
-  BufferOutStream *os = (BufferOutStream *)p;
-  os->size++;
+void closePpmdHandle(CPpmd7 *handle) {
+  Ppmd7_Free(handle, &g_BigAlloc);
 }
 
-static void setWrite(BufferOutStream *os) {
-  os->i.Write = write;
+static void freeThreadHandle(void *handle) {
+  closePpmdHandle((CPpmd7 *)handle);
+  free(handle);
 }
 
-static void initBufferOutStream(BufferOutStream *os) {
-  os->size = 0;
-  setWrite(os);
+static void createHandleKey(void) {
+  pthread_key_create(&handleKey, freeThreadHandle);
 }
 
-void initPpmdHandle(CPpmd7 *handle, size_t dicmem, unsigned order) {
-  Ppmd7_Construct(handle);
-  Ppmd7_Alloc(handle, dicmem, &g_Alloc);
+/* Return the model of the calling thread, initialized with the given order */
+static CPpmd7 *getThreadHandle(unsigned order) {
+  CPpmd7 *handle;
+
+  pthread_once(&handleKeyOnce, createHandleKey);
+  handle = (CPpmd7 *)pthread_getspecific(handleKey);
+  if (handle == NULL) {
+    handle = (CPpmd7 *)malloc(sizeof(CPpmd7));
+    if (handle == NULL)
+      return NULL;
+    Ppmd7_Construct(handle);
+    if (!Ppmd7_Alloc(handle, PPMD_DICMEM, &g_BigAlloc)) {
+      free(handle);
+      return NULL;
+    }
+    pthread_setspecific(handleKey, handle);
+  }
   Ppmd7_Init(handle, order);
+  return handle;
 }
 
-void closePpmdHandle(CPpmd7 *handle) {
-  Ppmd7_Free(handle, &g_Alloc);
+/* Encode the file from its current position up to the end, straight
+ * from the mapped contents of each file */
+static void encodeFile(CPpmd7 *handle, CPpmd7z_RangeCnt *desc, ncd_file_t *fin) {
+  const unsigned char *data;
+  ssize_t len;
+
+  while ((len = ncd_fsegment(fin, &data, (size_t)-1)) > 0)
+    Ppmd7_CountBuffer(handle, desc, data, len);
 }
 
+/** Model primed with file A (see ppmd_prefix_open()) */
+typedef struct {
+  CPpmd7 *handle;
+  CPpmd7_Snapshot snap;
+  CPpmd7z_RangeCnt desc;
+} PpmdPrefix;
 
 ssize_t ppmd_getcompsize(ncd_file_t *fin)
 {
-	int order = 9;
+	int order = PPMD_ORDER;
 	size_t outlen = 0;
-	int dicmem = 10 * 1024 * 1024;
-	CPpmd7 handle;
-	CPpmd7z_RangeEnc desc;
-	BufferOutStream os;
+	CPpmd7 *handle;
+	CPpmd7z_RangeCnt desc;
 	
-	initPpmdHandle(&handle, dicmem, order);
-	initBufferOutStream(&os);
-	desc.Stream = &os.i;
-	Ppmd7z_RangeEnc_Init(&desc);
-
-	while (!ncd_feof(fin)) {
-		Ppmd7_EncodeSymbol(&handle, &desc, ncd_getc(fin));
+	handle = getThreadHandle(order);
+	if (handle == NULL) {
+		ncd_err = -1;
+		return 0;
 	}
-	Ppmd7z_RangeEnc_FlushData(&desc);
+	Ppmd7z_RangeCnt_Init(&desc);
+
+	encodeFile(handle, &desc, fin);
+	Ppmd7z_RangeCnt_FlushData(&desc);
 
-	outlen = written(&os);
-	closePpmdHandle(&handle);
+	outlen = desc.Size;
 
 	return outlen;
 }
 
+
+/**
+ * \brief Encode file A and keep the model state for further A+B compressions
+ *
+ * \param fin File A
+ * \return void* Primed state, NULL on error
+ * \note The state is bound to the model of the calling thread, so it should
+ *       be used (and released) only by this thread
+ */
+void *ppmd_prefix_open(ncd_file_t *fin)
+{
+	PpmdPrefix *pf;
+
+	pf = (PpmdPrefix*)malloc(sizeof(PpmdPrefix));
+	if (pf == NULL || ncd_fseek(fin, 0, SEEK_SET) < 0) {
+		free(pf);
+		return NULL;
+	}
+
+	pf->handle = getThreadHandle(PPMD_ORDER);
+	if (pf->handle == NULL) {
+		free(pf);
+		return NULL;
+	}
+	Ppmd7_Snapshot_Construct(&pf->snap);
+	Ppmd7z_RangeCnt_Init(&pf->desc);
+
+	encodeFile(pf->handle, &pf->desc, fin);
+
+	/* Range encoder is kept unflushed, exactly as it is when
+	 * the encoder reaches the beginning of file B */
+	if (!Ppmd7_Snapshot_Save(&pf->snap, pf->handle, &g_Alloc)) {
+		free(pf);
+		return NULL;
+	}
+	return pf;
+}
+
+
+/**
+ * \brief Return compressed size of A+B restoring the model primed with A
+ *
+ * \param prefix State returned by ppmd_prefix_open()
+ * \param fin Concatenated file (A+B)
+ * \return ssize_t Compressed size
+ */
+ssize_t ppmd_prefix_getcompsize(void *prefix, ncd_file_t *fin)
+{
+	PpmdPrefix *pf = (PpmdPrefix*)prefix;
+	CPpmd7z_RangeCnt desc;
+
+	if (ncd_fseek(fin, fin->fileref[0]->fsize, SEEK_SET) < 0) {
+		ncd_err = -1;
+		return 0;
+	}
+
+	/* The thread model may have been used by other compressions
+	 * in the meantime, so it's always restored */
+	Ppmd7_Snapshot_Restore(&pf->snap, pf->handle);
+	desc = pf->desc;
+
+	encodeFile(pf->handle, &desc, fin);
+	Ppmd7z_RangeCnt_FlushData(&desc);
+
+	return desc.Size;
+}
+
+
+/**
+ * \brief Release state returned by ppmd_prefix_open()
+ */
+void ppmd_prefix_close(void *prefix)
+{
+	PpmdPrefix *pf = (PpmdPrefix*)prefix;
+
+	if (pf != NULL) {
+		Ppmd7_Snapshot_Free(&pf->snap, &g_Alloc);
+		free(pf);
+	}
+}
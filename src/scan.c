@@ -0,0 +1,815 @@
+/* ncd - Calculate NCD as fast as possible
+ * Copyright (C) 2018  Rene de Souza Pinto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "ncd.h"
+
+/** Size of the buffer of directory entries (see scan_read()) */
+#define SCAN_BUFSIZE (256 * 1024)
+/** Number of entries taken at once by each stat thread */
+#define SCAN_CHUNK   256
+
+/** Directory entry */
+typedef struct _scan_entry_t {
+	/** Offset of the name (see scan_t.names) */
+	size_t name;
+	/** Type from the directory (d_type) */
+	unsigned char type;
+	/** Should be 1 for regular files (after stat and filters) */
+	char reg;
+	/** Should be 1 for subdirectories to be walked */
+	char dir;
+	/** Should be 1 if the size is already known (no need to stat) */
+	char sized;
+	/** Error of stat (errno) */
+	int err;
+	/** File size */
+	ssize_t fsize;
+} scan_entry_t;
+
+/** Directory scan */
+typedef struct _scan_t {
+	/** Options (recursive mode and filters) */
+	ncd_opts_t *opts;
+	/** Directory path and file descriptor (NULL and AT_FDCWD for lists) */
+	char *path;
+	int dirfd;
+	/** Names of all entries (null terminated, one after the other) */
+	char *names;
+	size_t names_len, names_max;
+	/** Entries */
+	scan_entry_t *ents;
+	unsigned long n, max;
+	/** Next entry to be taken by a stat thread */
+	atomic_ulong next;
+} scan_t;
+
+/** Files found (only path and fsize are set until scan_dir() returns) */
+typedef struct _scan_list_t {
+	file_t *files;
+	unsigned long n, max;
+} scan_list_t;
+
+/** Recursive walk: directories are taken by a pool of threads */
+typedef struct _walk_t {
+	/** Options */
+	ncd_opts_t *opts;
+	/** Directories to be walked (stack) */
+	char **dirs;
+	unsigned long ndirs, maxdirs;
+	/** Number of threads walking a directory */
+	int busy;
+	/** Error indicator */
+	int err;
+	/** Files found */
+	scan_list_t list;
+	/** Lock of the structure and signal of new directories */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} walk_t;
+
+#ifdef SYS_getdents64
+/** Entry returned by getdents64() (not exported by the C library) */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+
+/**
+ * \brief Check whether a name matches any of the patterns
+ *
+ * \param patterns Glob patterns
+ * \param n Number of patterns
+ * \param name File (or directory) name
+ * \return int 1 if it matches, 0 otherwise
+ */
+static int scan_match(char **patterns, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (fnmatch(patterns[i], name, 0) == 0) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Append an entry to the scan (the array grows as needed)
+ *
+ * \param s Scan
+ * \param name Offset of the name (see scan_t.names)
+ * \param type Entry type (d_type)
+ * \return scan_entry_t* New entry, NULL on error
+ */
+static scan_entry_t *scan_push(scan_t *s, size_t name, unsigned char type)
+{
+	scan_entry_t *ents, *e;
+
+	if (s->n == s->max) {
+		s->max = (s->max == 0 ? 1024 : 2 * s->max);
+		ents   = (scan_entry_t*)realloc(s->ents, sizeof(scan_entry_t) * s->max);
+		if (ents == NULL) {
+			return (NULL);
+		}
+		s->ents = ents;
+	}
+	e        = &s->ents[s->n++];
+	e->name  = name;
+	e->type  = type;
+	e->reg   = 0;
+	e->dir   = (type == DT_DIR);
+	e->sized = 0;
+	e->err   = 0;
+	e->fsize = 0;
+	return (e);
+}
+
+
+/**
+ * \brief Add an entry to the scan (arrays grow as needed)
+ *
+ * Name filters are applied here, so excluded entries are never stat'ed.
+ *
+ * \param s Scan
+ * \param name Entry name
+ * \param type Entry type (d_type)
+ * \return int 0 on success, -1 otherwise
+ */
+static int scan_add(scan_t *s, const char *name, unsigned char type)
+{
+	size_t len = strlen(name) + 1;
+	ncd_opts_t *opts = s->opts;
+	char *names;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return (0);
+	} else if (type == DT_DIR && !opts->recursive) {
+		return (0);
+	} else if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN && type != DT_DIR) {
+		/* No need to stat devices, sockets, etc. */
+		return (0);
+	} else if (scan_match(opts->exclude, opts->n_exclude, name)) {
+		/* Excluded files and directories (whole subtree) */
+		return (0);
+	} else if ((type == DT_REG || type == DT_LNK) && opts->n_include > 0 &&
+			!scan_match(opts->include, opts->n_include, name)) {
+		return (0);
+	}
+
+	if (s->names_len + len > s->names_max) {
+		s->names_max = (s->names_max == 0 ? 64 * 1024 : 2 * s->names_max);
+		s->names_max = (s->names_max < s->names_len + len ? s->names_len + len : s->names_max);
+		names        = (char*)realloc(s->names, s->names_max);
+		if (names == NULL) {
+			return (-1);
+		}
+		s->names = names;
+	}
+
+	memcpy(&s->names[s->names_len], name, len);
+	if (scan_push(s, s->names_len, type) == NULL) {
+		return (-1);
+	}
+	s->names_len += len;
+	return (0);
+}
+
+
+/**
+ * \brief Read all entries of the directory, in a single pass
+ *
+ * \param s Scan
+ * \return int 0 on success, -1 otherwise
+ */
+static int scan_read(scan_t *s)
+{
+#ifdef SYS_getdents64
+	struct linux_dirent64 *de;
+	char *buf;
+	long nread, pos;
+
+	buf = (char*)malloc(SCAN_BUFSIZE);
+	if (buf == NULL) {
+		return (-1);
+	}
+	while ((nread = syscall(SYS_getdents64, s->dirfd, buf, SCAN_BUFSIZE)) > 0) {
+		for (pos = 0; pos < nread; pos += de->d_reclen) {
+			de = (struct linux_dirent64*)&buf[pos];
+			if (scan_add(s, de->d_name, de->d_type) < 0) {
+				free(buf);
+				return (-1);
+			}
+		}
+	}
+	free(buf);
+	return (nread < 0 ? -1 : 0);
+#else
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	if ((fd = dup(s->dirfd)) < 0 || (dir = fdopendir(fd)) == NULL) {
+		if (fd >= 0) close(fd);
+		return (-1);
+	}
+	while ((de = readdir(dir))) {
+		if (scan_add(s, de->d_name, de->d_type) < 0) {
+			closedir(dir);
+			return (-1);
+		}
+	}
+	closedir(dir);
+	return (0);
+#endif
+}
+
+
+/**
+ * \brief Open and read a directory
+ *
+ * \param s Scan
+ * \param path Directory
+ * \param opts Options
+ * \return int 0 on success, -1 otherwise
+ */
+static int scan_open(scan_t *s, char *path, ncd_opts_t *opts)
+{
+	memset(s, 0, sizeof(scan_t));
+	s->opts  = opts;
+	s->path  = path;
+	s->dirfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (s->dirfd < 0 || scan_read(s) < 0) {
+		perror(path);
+		if (s->dirfd >= 0) close(s->dirfd);
+		free(s->ents);
+		free(s->names);
+		return (-1);
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Release a scan
+ */
+static void scan_close(scan_t *s)
+{
+	close(s->dirfd);
+	free(s->ents);
+	free(s->names);
+}
+
+
+/**
+ * \brief Apply the filters which need the type or the size of an entry
+ *
+ * \param s Scan
+ * \param e Entry
+ */
+static void scan_filter(scan_t *s, scan_entry_t *e)
+{
+	ncd_opts_t *opts = s->opts;
+
+	if (e->reg && e->type == DT_UNKNOWN && opts->n_include > 0 &&
+			!scan_match(opts->include, opts->n_include, &s->names[e->name])) {
+		e->reg = 0;
+	} else if (e->reg && (e->fsize < (ssize_t)opts->min_size ||
+				(opts->max_size > 0 && e->fsize > (ssize_t)opts->max_size))) {
+		e->reg = 0;
+	}
+}
+
+
+/**
+ * \brief Get type and size of an entry and apply the filters
+ *
+ * \param s Scan
+ * \param e Entry
+ */
+static void scan_entry(scan_t *s, scan_entry_t *e)
+{
+	ncd_opts_t *opts = s->opts;
+	int flags = 0;
+	mode_t mode;
+#if HAVE_STATX
+	struct statx stx;
+#else
+	struct stat st;
+#endif
+
+	if (e->dir) {
+		return;
+	} else if (e->sized) {
+		e->reg = 1;
+		scan_filter(s, e);
+		return;
+	} else if (e->type == DT_UNKNOWN && opts->recursive) {
+		/* It could be a link to a directory (which is not walked) */
+		flags = AT_SYMLINK_NOFOLLOW;
+	}
+
+	/* Symbolic links to files are followed (as stat() does) */
+	do {
+#if HAVE_STATX
+		if (statx(s->dirfd, &s->names[e->name], flags, STATX_TYPE | STATX_SIZE, &stx) < 0) {
+			e->err = errno;
+			return;
+		}
+		mode     = stx.stx_mode;
+		e->fsize = stx.stx_size;
+#else
+		if (fstatat(s->dirfd, &s->names[e->name], &st, flags) < 0) {
+			e->err = errno;
+			return;
+		}
+		mode     = st.st_mode;
+		e->fsize = st.st_size;
+#endif
+		if (S_ISLNK(mode)) {
+			flags = 0;
+		} else if (S_ISDIR(mode) && flags == AT_SYMLINK_NOFOLLOW) {
+			e->dir = 1;
+			flags  = 0;
+		}
+	} while (S_ISLNK(mode));
+
+	e->reg = S_ISREG(mode);
+	scan_filter(s, e);
+}
+
+
+/**
+ * \brief Stat entries (thread function)
+ *
+ * \param arg Scan (scan_t)
+ * \return NULL
+ */
+static void *scan_thread(void *arg)
+{
+	scan_t *s = (scan_t*)arg;
+	unsigned long k, kend;
+
+	while ((k = atomic_fetch_add(&s->next, SCAN_CHUNK)) < s->n) {
+		kend = (k + SCAN_CHUNK < s->n ? k + SCAN_CHUNK : s->n);
+		for (; k < kend; k++) {
+			scan_entry(s, &s->ents[k]);
+		}
+	}
+	return (NULL);
+}
+
+
+/**
+ * \brief Stat all entries, across threads
+ *
+ * \param s Scan
+ * \param n_threads Number of threads
+ */
+static void scan_stat(scan_t *s, int n_threads)
+{
+	pthread_t *threads;
+	int t;
+
+	if ((unsigned long)n_threads > (s->n + SCAN_CHUNK - 1) / SCAN_CHUNK) {
+		n_threads = (int)((s->n + SCAN_CHUNK - 1) / SCAN_CHUNK);
+	}
+	threads = (pthread_t*)malloc(sizeof(pthread_t) * (n_threads + 1));
+
+	atomic_init(&s->next, 0);
+	for (t = 1; threads != NULL && t < n_threads; t++) {
+		if (pthread_create(&threads[t], NULL, scan_thread, s) != 0) {
+			break;
+		}
+	}
+	scan_thread(s);
+	while (threads != NULL && --t > 0) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+}
+
+
+/**
+ * \brief Add the regular files of a scan to a list
+ *
+ * \param s Scan
+ * \param list List of files
+ * \return int 0 on success, -1 otherwise
+ */
+static int scan_files(scan_t *s, scan_list_t *list)
+{
+	unsigned long k;
+	file_t *files;
+	char *fpath;
+
+	for (k = 0; k < s->n; k++) {
+		if (s->ents[k].err == 0 && !s->ents[k].reg) {
+			continue;
+		}
+		if (s->path == NULL) {
+			fpath = strdup(&s->names[s->ents[k].name]);
+		} else {
+			fpath = get_fullpath(s->path, &s->names[s->ents[k].name]);
+		}
+		if (s->ents[k].err != 0 || fpath == NULL) {
+			/* Stat failed */
+			errno = (s->ents[k].err != 0 ? s->ents[k].err : ENOMEM);
+			perror(fpath != NULL ? fpath : &s->names[s->ents[k].name]);
+			free(fpath);
+			return (-1);
+		}
+
+		if (list->n == list->max) {
+			list->max = (list->max == 0 ? 1024 : 2 * list->max);
+			files     = (file_t*)realloc(list->files, sizeof(file_t) * list->max);
+			if (files == NULL) {
+				perror("scan_files()");
+				free(fpath);
+				return (-1);
+			}
+			list->files = files;
+		}
+		list->files[list->n].path  = fpath;
+		list->files[list->n].fsize = s->ents[k].fsize;
+		list->n++;
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Walk directories (thread function)
+ *
+ * Each thread takes a directory, lists and stats its entries, and gives its
+ * subdirectories back to the pool. Threads are done when there are no
+ * directories left and no thread is walking one.
+ *
+ * \param arg Walk (walk_t)
+ * \return NULL
+ */
+static void *walk_thread(void *arg)
+{
+	walk_t *w = (walk_t*)arg;
+	unsigned long k;
+	char *dir, *sub, **dirs;
+	int ret, opened;
+	scan_t s;
+
+	pthread_mutex_lock(&w->mutex);
+	while (1) {
+		while (w->ndirs == 0 && w->busy > 0 && w->err == 0) {
+			pthread_cond_wait(&w->cond, &w->mutex);
+		}
+		if (w->ndirs == 0 || w->err != 0) {
+			break;
+		}
+		dir = w->dirs[--w->ndirs];
+		w->busy++;
+		pthread_mutex_unlock(&w->mutex);
+
+		ret    = scan_open(&s, dir, w->opts);
+		opened = (ret == 0);
+		if (opened) {
+			atomic_init(&s.next, 0);
+			scan_thread(&s);
+		}
+
+		pthread_mutex_lock(&w->mutex);
+		if (ret == 0 && scan_files(&s, &w->list) < 0) {
+			ret = -1;
+		}
+		for (k = 0; ret == 0 && k < s.n; k++) {
+			if (!s.ents[k].dir) {
+				continue;
+			} else if (w->ndirs == w->maxdirs) {
+				w->maxdirs = (w->maxdirs == 0 ? 64 : 2 * w->maxdirs);
+				dirs       = (char**)realloc(w->dirs, sizeof(char*) * w->maxdirs);
+				if (dirs == NULL) {
+					ret = -1;
+					break;
+				}
+				w->dirs = dirs;
+			}
+			sub = get_fullpath(dir, &s.names[s.ents[k].name]);
+			if (sub == NULL) {
+				ret = -1;
+				break;
+			}
+			w->dirs[w->ndirs++] = sub;
+		}
+		if (opened) {
+			scan_close(&s);
+		}
+		w->err |= (ret < 0);
+		w->busy--;
+		free(dir);
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return (NULL);
+}
+
+
+/**
+ * \brief Walk a directory tree with a pool of threads
+ *
+ * \param root Root directory
+ * \param opts Options
+ * \param n_threads Number of threads
+ * \param list Returns the files found
+ * \return int 0 on success, -1 otherwise
+ */
+static int walk_tree(char *root, ncd_opts_t *opts, int n_threads, scan_list_t *list)
+{
+	pthread_t *threads;
+	unsigned long k;
+	walk_t w;
+	int t;
+
+	memset(&w, 0, sizeof(walk_t));
+	w.opts    = opts;
+	w.maxdirs = 64;
+	w.dirs    = (char**)malloc(sizeof(char*) * w.maxdirs);
+	threads   = (pthread_t*)malloc(sizeof(pthread_t) * (n_threads + 1));
+	if (w.dirs == NULL || threads == NULL || (w.dirs[0] = strdup(root)) == NULL) {
+		perror("walk_tree()");
+		free(w.dirs);
+		free(threads);
+		return (-1);
+	}
+	w.ndirs = 1;
+	pthread_mutex_init(&w.mutex, NULL);
+	pthread_cond_init(&w.cond, NULL);
+
+	for (t = 1; t < n_threads; t++) {
+		if (pthread_create(&threads[t], NULL, walk_thread, &w) != 0) {
+			break;
+		}
+	}
+	walk_thread(&w);
+	while (--t > 0) {
+		pthread_join(threads[t], NULL);
+	}
+
+	/* Directories left behind (on error) */
+	for (k = 0; k < w.ndirs; k++) {
+		free(w.dirs[k]);
+	}
+	free(w.dirs);
+	free(threads);
+	pthread_mutex_destroy(&w.mutex);
+	pthread_cond_destroy(&w.cond);
+	*list = w.list;
+	return (w.err ? -1 : 0);
+}
+
+
+/**
+ * \brief Read the whole manifest
+ *
+ * \param manifest Path of the manifest ("-" for stdin)
+ * \param len Returns the length of the manifest
+ * \return char* Contents (null terminated, allocated with malloc()), NULL on error
+ */
+static char *scan_manifest(char *manifest, size_t *len)
+{
+	size_t max = 64 * 1024;
+	char *buf, *nbuf;
+	ssize_t rd;
+	int fd;
+
+	fd = (strcmp(manifest, "-") == 0 ? STDIN_FILENO : open(manifest, O_RDONLY));
+	if (fd < 0 || (buf = (char*)malloc(max + 1)) == NULL) {
+		perror(manifest);
+		if (fd > STDIN_FILENO) close(fd);
+		return (NULL);
+	}
+
+	*len = 0;
+	while ((rd = read(fd, &buf[*len], max - *len)) != 0) {
+		if (rd < 0 && errno == EINTR) {
+			continue;
+		} else if (rd < 0) {
+			perror(manifest);
+			free(buf);
+			buf = NULL;
+			break;
+		}
+		*len += rd;
+		if (*len == max) {
+			max *= 2;
+			if ((nbuf = (char*)realloc(buf, max + 1)) == NULL) {
+				perror(manifest);
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = nbuf;
+		}
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	if (buf != NULL) {
+		buf[*len] = '\0';
+	}
+	return (buf);
+}
+
+
+/**
+ * \brief List the files named by a manifest
+ *
+ * The manifest has one path per line, or per null terminated record when
+ * it has any null character (as from find -print0). A path can be preceded
+ * by its size and a tab ("SIZE\tPATH", as from find -printf '%s\t%p\n'),
+ * so it's not stat'ed (the size is checked when the file is opened, see
+ * ncd_open()). Other paths are stat'ed across threads. Files keep
+ * the manifest order and are labeled by their paths. Filters apply as in
+ * directory mode (globs are matched against the whole path), and entries
+ * which are not regular files are skipped.
+ *
+ * \param manifest Path of the manifest ("-" for stdin)
+ * \param files Returns the list of files (allocated with malloc())
+ * \param opts Options (filters)
+ * \param n_threads Number of threads
+ * \return long Number of files, -1 on error
+ */
+long scan_list(char *manifest, file_t **files, ncd_opts_t *opts, int n_threads)
+{
+	scan_list_t list;
+	scan_entry_t *e;
+	size_t len, pos, end, fsize;
+	char delim, *path, *p;
+	unsigned long k;
+	scan_t s;
+	int ret = 0;
+
+	memset(&s, 0, sizeof(scan_t));
+	memset(&list, 0, sizeof(scan_list_t));
+	s.opts  = opts;
+	s.path  = NULL;
+	s.dirfd = AT_FDCWD;
+	if ((s.names = scan_manifest(manifest, &len)) == NULL) {
+		return (-1);
+	}
+
+	/* Split records (in place) */
+	delim = (memchr(s.names, '\0', len) != NULL ? '\0' : '\n');
+	for (pos = 0; pos < len && ret == 0; pos = end + 1) {
+		p   = (char*)memchr(&s.names[pos], delim, len - pos);
+		end = (p != NULL ? (size_t)(p - s.names) : len);
+		s.names[end] = '\0';
+		if (delim == '\n' && end > pos && s.names[end - 1] == '\r') {
+			s.names[end - 1] = '\0';
+		}
+
+		/* Optional size */
+		path  = &s.names[pos];
+		fsize = strtoul(path, &p, 10);
+		if (p != path && *p == '\t' && isdigit((unsigned char)path[0])) {
+			path = p + 1;
+		} else {
+			p = NULL;
+		}
+		if (path[0] == '\0' || scan_match(opts->exclude, opts->n_exclude, path) ||
+				(opts->n_include > 0 && !scan_match(opts->include, opts->n_include, path))) {
+			continue;
+		}
+
+		if ((e = scan_push(&s, path - s.names, DT_REG)) == NULL) {
+			perror("scan_list()");
+			ret = -1;
+		} else if (p != NULL) {
+			e->sized = 1;
+			e->fsize = fsize;
+		}
+	}
+
+	if (ret == 0) {
+		scan_stat(&s, n_threads);
+		ret = scan_files(&s, &list);
+	}
+	free(s.ents);
+	free(s.names);
+
+	if (ret < 0) {
+		for (k = 0; k < list.n; k++) {
+			free(list.files[k].path);
+		}
+		free(list.files);
+		return (-1);
+	}
+	for (k = 0; k < list.n; k++) {
+		ncd_file_init(&list.files[k], list.files[k].path, list.files[k].fsize);
+		list.files[k].label = list.files[k].path;
+	}
+	*files = (list.files != NULL ? list.files : (file_t*)malloc(sizeof(file_t)));
+	return ((long)list.n);
+}
+
+
+/**
+ * \brief Compare files by path (see qsort())
+ */
+static int cmp_path(const void *a, const void *b)
+{
+	return (strcmp(((const file_t*)a)->path, ((const file_t*)b)->path));
+}
+
+
+/**
+ * \brief List the regular files of a directory
+ *
+ * The directory is read in a single pass (getdents64() on Linux), entries
+ * whose type (d_type) is known not to be a regular file are not even
+ * stat'ed, and the others are stat'ed across threads relative to the
+ * directory descriptor. Files are listed in directory order. On recursive
+ * mode, subdirectories are walked by a pool of threads and files are
+ * sorted by path. Name filters (include and exclude globs) are applied
+ * before stat, and size filters right after it.
+ *
+ * \param dir Directory
+ * \param files Returns the list of files (allocated with malloc())
+ * \param opts Options (recursive mode and filters)
+ * \param n_threads Number of threads
+ * \return long Number of files, -1 on error
+ */
+long scan_dir(char *dir, file_t **files, ncd_opts_t *opts, int n_threads)
+{
+	scan_list_t list;
+	unsigned long k;
+	size_t rootlen;
+	char *root;
+	scan_t s;
+	int ret;
+
+	memset(&list, 0, sizeof(scan_list_t));
+	if (opts->recursive) {
+		ret = walk_tree(dir, opts, n_threads, &list);
+		if (ret == 0 && list.n > 1) {
+			qsort(list.files, list.n, sizeof(file_t), cmp_path);
+		}
+	} else if ((ret = scan_open(&s, dir, opts)) == 0) {
+		scan_stat(&s, n_threads);
+		ret = scan_files(&s, &list);
+		scan_close(&s);
+	}
+
+	if (ret < 0) {
+		for (k = 0; k < list.n; k++) {
+			free(list.files[k].path);
+		}
+		free(list.files);
+		return (-1);
+	}
+
+	/* Files of subdirectories are labeled by their path from the root */
+	root    = get_fullpath(dir, "");
+	rootlen = (root != NULL ? strlen(root) : 0);
+	free(root);
+	for (k = 0; k < list.n; k++) {
+		ncd_file_init(&list.files[k], list.files[k].path, list.files[k].fsize);
+		if (opts->recursive) {
+			list.files[k].label = &list.files[k].path[rootlen];
+		}
+	}
+	*files = (list.files != NULL ? list.files : (file_t*)malloc(sizeof(file_t)));
+	return ((long)list.n);
+}
@@ -0,0 +1,962 @@
+/* ncd - Calculate NCD as fast as possible
+ * Copyright (C) 2018  Rene de Souza Pinto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "ncd.h"
+
+/** Estimated cost (in bytes) of each pair, besides compressing the files */
+#define SCHED_PAIR_COST 4096
+/** Lines are split when they cost more than 1/(threads * SCHED_SPLIT) of all */
+#define SCHED_SPLIT     4
+
+extern file_t *ncd_files;
+extern unsigned long ncd_total_files;
+
+/** Scheduler options */
+static ncd_opts_t *sched_opts;
+
+/** Queue of tasks (range of task indexes) */
+typedef struct _sched_queue_t {
+	/** Next task to be taken by a thread */
+	atomic_ulong next;
+	/** End of the queue */
+	unsigned long end;
+} sched_queue_t;
+
+/** Total number of tasks */
+static unsigned long total_tasks;
+/** Number of matrix lines (first files) and first column (see sched_init()) */
+static unsigned long total_rows, first_col;
+/** Number of queues (one per NUMA node) */
+static int nqueues;
+/** Queues of matrix tasks */
+static sched_queue_t *queues = NULL;
+/** Queues of files (single compressions) */
+static sched_queue_t *fqueues = NULL;
+
+/** List of tasks (line granularity), sorted by cost */
+static ncd_task_t *tasks = NULL;
+/** Order of the lines (first line of each block) to be processed */
+static unsigned long *roworder = NULL;
+/** Cost of each entry of roworder */
+static size_t *rowcost = NULL;
+/** Order of the files to be compressed alone */
+static unsigned long *fileorder = NULL;
+
+/** First file of each column block (plus the total of files at the end) */
+static unsigned long *colblocks = NULL;
+/** Number of column blocks */
+static unsigned long total_colblocks;
+
+/** Sum of the sizes of all files before each file */
+static size_t *fsum = NULL;
+
+/** Number of threads which have no more tasks to take */
+static atomic_int idle_threads;
+
+/** Measured throughput of each node: processed cost (bytes) and time (ns) */
+static atomic_ullong *done_cost = NULL, *done_nsecs = NULL;
+
+/** Memory budget (0 = unlimited) and memory reserved by running tasks */
+static size_t mem_limit, mem_used;
+/** Memory of each compressor state (reserved for each borrowed thread) */
+static size_t mem_ctx;
+/** Signal threads waiting for memory */
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_cond   = PTHREAD_COND_INITIALIZER;
+
+/** Jobs lent to idle threads (see sched_lend()) */
+static sched_job_t *job_head = NULL, *job_tail = NULL;
+/** Number of threads still taking tasks (only they can lend jobs) */
+static int active_threads;
+/** Signal idle threads (new jobs) and lenders (jobs done) */
+static pthread_mutex_t job_mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond     = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobdone_cond = PTHREAD_COND_INITIALIZER;
+
+
+/**
+ * \brief Estimate the cost (in bytes to compress) of a matrix tile
+ *
+ * \param r0 First line
+ * \param nr Number of lines
+ * \param c0 First column
+ * \param nc Number of columns
+ * \return size_t Estimated cost
+ * \note Each line compresses A once (prefix) followed by each B, unless
+ *       the tile has only one column, when the whole AB is compressed
+ */
+static size_t tile_cost(unsigned long r0, unsigned long nr, unsigned long c0, unsigned long nc)
+{
+	unsigned long i, j, cend, npairs;
+	size_t cost, bsize;
+
+	cost = 0;
+	cend = c0 + nc;
+	for (i = r0; i < (r0 + nr); i++) {
+		j = c0;
+		if (sched_opts->symmetric == NCD_SYM_AB && j <= i) {
+			j = i + 1;
+		}
+		if (j >= cend) {
+			continue;
+		}
+		npairs = cend - j;
+		bsize  = fsum[cend] - fsum[j];
+		if (i >= j && i < cend) {
+			/* Skip diagonal */
+			npairs--;
+			bsize -= ncd_files[i].fsize;
+		}
+		if (npairs == 0) {
+			continue;
+		}
+		cost += bsize + (npairs * SCHED_PAIR_COST);
+		cost += (nc > 1 ? ncd_files[i].fsize : npairs * ncd_files[i].fsize);
+	}
+	return (cost);
+}
+
+
+/**
+ * \brief Compare tasks by cost (descending), then position
+ */
+static int cmp_task(const void *a, const void *b)
+{
+	const ncd_task_t *ta = (const ncd_task_t*)a;
+	const ncd_task_t *tb = (const ncd_task_t*)b;
+
+	if (ta->cost != tb->cost) {
+		return (ta->cost > tb->cost ? -1 : 1);
+	} else if (ta->r0 != tb->r0) {
+		return (ta->r0 < tb->r0 ? -1 : 1);
+	} else if (ta->c0 != tb->c0) {
+		return (ta->c0 < tb->c0 ? -1 : 1);
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Sort entries by cost (descending)
+ *
+ * \param order Entries
+ * \param cost Cost of each entry (or NULL to use file sizes)
+ * \param n Number of entries
+ * \return int 0 on success, -1 otherwise
+ */
+static int sort_order(unsigned long *order, size_t *cost, unsigned long n)
+{
+	unsigned long i;
+	ncd_task_t *t;
+
+	/* Use tasks just to sort */
+	t = (ncd_task_t*)malloc(sizeof(ncd_task_t) * (n > 0 ? n : 1));
+	if (t == NULL) {
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		t[i].r0   = order[i];
+		t[i].c0   = 0;
+		t[i].cost = (cost != NULL ? cost[i] : ncd_files[order[i]].fsize);
+	}
+	qsort(t, n, sizeof(ncd_task_t), cmp_task);
+	for (i = 0; i < n; i++) {
+		order[i] = t[i].r0;
+		if (cost != NULL) {
+			cost[i] = t[i].cost;
+		}
+	}
+	free(t);
+	return (0);
+}
+
+
+/**
+ * \brief Return the queue (NUMA node) of the tasks of a line
+ *
+ * Lines are split among nodes by the size of their files, so each node
+ * reads (and first touches) mostly the same files A.
+ */
+static int line_queue(unsigned long r)
+{
+	int k;
+
+	if (nqueues == 1 || fsum[ncd_total_files] == 0) {
+		return (0);
+	}
+	/* Lines after the last non-empty file would be past the last node */
+	k = (int)(((double)fsum[r] / fsum[ncd_total_files]) * nqueues);
+	return (k < nqueues ? k : nqueues - 1);
+}
+
+
+/**
+ * \brief Group entries by queue, keeping their order within each queue
+ *
+ * \param order Entries (lines or files)
+ * \param cost Cost of each entry (it can be NULL)
+ * \param n Number of entries
+ * \param q Queues to receive the range of each group
+ * \param mul Number of tasks of each entry
+ * \return int 0 on success, -1 otherwise
+ */
+static int group_order(unsigned long *order, size_t *cost, unsigned long n,
+						sched_queue_t *q, unsigned long mul)
+{
+	unsigned long i, *pos, *torder;
+	size_t *tcost;
+	int k;
+
+	pos    = (unsigned long*)calloc(nqueues + 1, sizeof(unsigned long));
+	torder = (unsigned long*)malloc(sizeof(unsigned long) * (n + 1));
+	tcost  = (size_t*)malloc(sizeof(size_t) * (n + 1));
+	if (pos == NULL || torder == NULL || tcost == NULL) {
+		free(pos); free(torder); free(tcost);
+		return (-1);
+	}
+
+	for (i = 0; i < n; i++) {
+		pos[line_queue(order[i]) + 1]++;
+	}
+	for (k = 0; k < nqueues; k++) {
+		pos[k + 1]  += pos[k];
+		q[k].end     = pos[k + 1] * mul;
+		atomic_store(&q[k].next, pos[k] * mul);
+	}
+	for (i = 0; i < n; i++) {
+		k = line_queue(order[i]);
+		torder[pos[k]] = order[i];
+		tcost[pos[k]]  = (cost != NULL ? cost[i] : 0);
+		pos[k]++;
+	}
+
+	/* Every entry should be queued exactly once */
+	for (k = 0; k < nqueues; k++) {
+		if (pos[k] * mul != q[k].end || q[nqueues - 1].end != n * mul) {
+			free(pos); free(torder); free(tcost);
+			return (-1);
+		}
+	}
+	memcpy(order, torder, sizeof(unsigned long) * n);
+	if (cost != NULL) {
+		memcpy(cost, tcost, sizeof(size_t) * n);
+	}
+
+	free(pos);
+	free(torder);
+	free(tcost);
+	return (0);
+}
+
+
+/**
+ * \brief Append a task to the list
+ *
+ * \param size Allocated entries
+ * \return int 0 on success, -1 otherwise
+ */
+static int add_task(unsigned long *size, unsigned long r0, unsigned long nr,
+					unsigned long c0, unsigned long nc, size_t cost)
+{
+	ncd_task_t *t;
+
+	if (total_tasks >= *size) {
+		t = (ncd_task_t*)realloc(tasks, sizeof(ncd_task_t) * (*size) * 2);
+		if (t == NULL) {
+			return (-1);
+		}
+		tasks  = t;
+		*size *= 2;
+	}
+	tasks[total_tasks].r0   = r0;
+	tasks[total_tasks].nr   = nr;
+	tasks[total_tasks].c0   = c0;
+	tasks[total_tasks].nc   = nc;
+	tasks[total_tasks].cost = cost;
+	total_tasks++;
+	return (0);
+}
+
+
+/**
+ * \brief Group the list of tasks by queue, keeping their order
+ *
+ * \return int 0 on success, -1 otherwise
+ */
+static int group_tasks(void)
+{
+	unsigned long i, *pos;
+	ncd_task_t *t;
+	int k;
+
+	pos = (unsigned long*)calloc(nqueues + 1, sizeof(unsigned long));
+	t   = (ncd_task_t*)malloc(sizeof(ncd_task_t) * (total_tasks + 1));
+	if (pos == NULL || t == NULL) {
+		free(pos); free(t);
+		return (-1);
+	}
+
+	for (i = 0; i < total_tasks; i++) {
+		pos[line_queue(tasks[i].r0) + 1]++;
+	}
+	for (k = 0; k < nqueues; k++) {
+		pos[k + 1]   += pos[k];
+		queues[k].end = pos[k + 1];
+		atomic_store(&queues[k].next, pos[k]);
+	}
+	for (i = 0; i < total_tasks; i++) {
+		k = line_queue(tasks[i].r0);
+		t[pos[k]++] = tasks[i];
+	}
+
+	/* Every task should be queued exactly once */
+	for (k = 0; k < nqueues; k++) {
+		if (pos[k] != queues[k].end || queues[nqueues - 1].end != total_tasks) {
+			free(pos); free(t);
+			return (-1);
+		}
+	}
+
+	free(tasks);
+	free(pos);
+	tasks = t;
+	return (0);
+}
+
+
+/**
+ * \brief Build the list of line tasks, splitting the oversized ones
+ *
+ * \param n_threads Number of threads
+ * \param rblocks Number of blocks of lines
+ * \return int 0 on success, -1 otherwise
+ */
+static int build_line_tasks(int n_threads, unsigned long rblocks)
+{
+	unsigned long b, r0, nr, j, c0, size, rows = sched_opts->tile_rows;
+	size_t total, limit, cost, ccost;
+
+	size  = rblocks + 1;
+	tasks = (ncd_task_t*)malloc(sizeof(ncd_task_t) * size);
+	if (tasks == NULL) {
+		return (-1);
+	}
+
+	total = 0;
+	for (b = 0; b < rblocks; b++) {
+		total += rowcost[b];
+	}
+	limit = total / ((size_t)n_threads * SCHED_SPLIT);
+
+	for (b = 0; b < rblocks; b++) {
+		r0 = roworder[b];
+		nr = ((r0 + rows) > total_rows ? total_rows - r0 : rows);
+		if (n_threads == 1 || rowcost[b] <= limit) {
+			if (add_task(&size, r0, nr, first_col, ncd_total_files - first_col, rowcost[b]) < 0) {
+				return (-1);
+			}
+			continue;
+		}
+
+		/* Split the lines into groups of columns, each group
+		 * down to a single column (pair) if necessary */
+		c0 = first_col;
+		for (j = first_col; j < ncd_total_files; j++) {
+			cost  = tile_cost(r0, nr, c0, j - c0 + 1);
+			ccost = (j > c0 ? tile_cost(r0, nr, c0, j - c0) : 0);
+			if (j > c0 && cost > limit) {
+				if (ccost > 0 && add_task(&size, r0, nr, c0, j - c0, ccost) < 0) {
+					return (-1);
+				}
+				c0 = j;
+			}
+		}
+		ccost = tile_cost(r0, nr, c0, ncd_total_files - c0);
+		if (ccost > 0 && add_task(&size, r0, nr, c0, ncd_total_files - c0, ccost) < 0) {
+			return (-1);
+		}
+	}
+
+	qsort(tasks, total_tasks, sizeof(ncd_task_t), cmp_task);
+	return (group_tasks());
+}
+
+
+/**
+ * \brief Initialize the scheduler
+ *
+ * Work is done in two phases: each file is compressed alone once (see
+ * sched_next_file()), then matrix tasks are taken (see sched_next()).
+ * Both are ordered by their estimated cost (longest first), which is based
+ * on the file sizes. For line granularity, lines costing much more than the
+ * average share of each thread are split into smaller groups of columns.
+ * There is a queue of files and tasks for each NUMA node in use: lines are
+ * split among them and threads take tasks from other queues when theirs
+ * are empty. On rectangular mode (opts->queries > 0), lines are only the
+ * first (query) files and columns are the remaining (corpus) files.
+ *
+ * \param opts NCD options
+ * \param n_threads Number of threads
+ * \param ctxmem Memory of each compressor state (see sched_borrow())
+ * \return long Number of matrix tasks (0 on size mode), -1 on error
+ */
+long sched_init(ncd_opts_t *opts, int n_threads, size_t ctxmem)
+{
+	unsigned long i, j, ncols, rblocks, rows;
+	size_t tbytes;
+
+	sched_opts  = opts;
+	total_tasks = 0;
+	total_rows  = (opts->queries > 0 ? opts->queries : ncd_total_files);
+	first_col   = opts->queries;
+	rows        = (opts->task == NCD_TASK_PAIR ? 1 : opts->tile_rows);
+	rblocks     = (opts->csize == 1 ? 0 : (total_rows + rows - 1) / rows);
+	nqueues     = topo_nodes();
+	atomic_store(&idle_threads, 0);
+	active_threads = n_threads;
+	job_head    = NULL;
+	job_tail    = NULL;
+	mem_limit   = opts->mem_limit;
+	mem_used    = 0;
+	mem_ctx     = ctxmem;
+
+	fsum      = (size_t*)malloc(sizeof(size_t) * (ncd_total_files + 1));
+	colblocks = (unsigned long*)malloc(sizeof(unsigned long) * (ncd_total_files + 1));
+	roworder  = (unsigned long*)malloc(sizeof(unsigned long) * (rblocks + 1));
+	rowcost   = (size_t*)malloc(sizeof(size_t) * (rblocks + 1));
+	fileorder = (unsigned long*)malloc(sizeof(unsigned long) * (ncd_total_files + 1));
+	queues    = (sched_queue_t*)calloc(nqueues, sizeof(sched_queue_t));
+	fqueues   = (sched_queue_t*)calloc(nqueues, sizeof(sched_queue_t));
+	done_cost  = (atomic_ullong*)calloc(nqueues, sizeof(atomic_ullong));
+	done_nsecs = (atomic_ullong*)calloc(nqueues, sizeof(atomic_ullong));
+	if (fsum == NULL || colblocks == NULL || roworder == NULL ||
+			rowcost == NULL || fileorder == NULL || queues == NULL ||
+			fqueues == NULL || done_cost == NULL || done_nsecs == NULL) {
+		sched_free();
+		return (-1);
+	}
+
+	/* Split columns into blocks of files which fit in tile memory */
+	total_colblocks = 0;
+	tbytes          = 0;
+	fsum[0]         = 0;
+	for (j = 0, ncols = 0; j < ncd_total_files; j++, ncols++) {
+		if (j < first_col) {
+			fsum[j + 1] = fsum[j] + ncd_files[j].fsize;
+			continue;
+		} else if (j == first_col || ncols >= NCD_TILE_COLS ||
+				(tbytes + ncd_files[j].fsize) > opts->tile_mem) {
+			colblocks[total_colblocks++] = j;
+			tbytes = 0;
+			ncols  = 0;
+		}
+		tbytes     += ncd_files[j].fsize;
+		fsum[j + 1] = fsum[j] + ncd_files[j].fsize;
+	}
+	colblocks[total_colblocks] = ncd_total_files;
+
+	/* Cost of each file and block of lines */
+	for (i = 0; i < ncd_total_files; i++) {
+		fileorder[i] = i;
+	}
+	for (i = 0; i < rblocks; i++) {
+		roworder[i] = i * rows;
+		rowcost[i]  = tile_cost(i * rows,
+				((i * rows + rows) > total_rows ? total_rows - i * rows : rows),
+				first_col, ncd_total_files - first_col);
+	}
+	if (sort_order(fileorder, NULL, ncd_total_files) < 0 ||
+			sort_order(roworder, rowcost, rblocks) < 0 ||
+			group_order(fileorder, NULL, ncd_total_files, fqueues, 1) < 0) {
+		sched_free();
+		return (-1);
+	}
+
+	if (opts->csize == 1) {
+		total_tasks = 0;
+	} else if (opts->task == NCD_TASK_TILE) {
+		total_tasks = rblocks * total_colblocks;
+		if (group_order(roworder, rowcost, rblocks, queues, total_colblocks) < 0) {
+			sched_free();
+			return (-1);
+		}
+	} else if (opts->task == NCD_TASK_PAIR) {
+		total_tasks = total_rows * (ncd_total_files - first_col);
+		if (group_order(roworder, rowcost, rblocks, queues, ncd_total_files - first_col) < 0) {
+			sched_free();
+			return (-1);
+		}
+	} else if (build_line_tasks(n_threads, rblocks) < 0) {
+		sched_free();
+		return (-1);
+	}
+
+	return ((long)total_tasks);
+}
+
+
+/**
+ * \brief Take a task index from a queue (or from the others, when it's empty)
+ *
+ * \param q Queues
+ * \param node Queue of the thread (NUMA node)
+ * \param k Task index
+ * \return int 1 if a task was taken, 0 if all queues are empty
+ */
+static int queue_take(sched_queue_t *q, int node, unsigned long *k)
+{
+	int i, n;
+
+	for (i = 0; i < nqueues; i++) {
+		n = (node + i) % nqueues;
+		if (atomic_load(&q[n].next) < q[n].end) {
+			*k = atomic_fetch_add(&q[n].next, 1);
+			if (*k < q[n].end) {
+				return (1);
+			}
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Get the next file to be compressed alone
+ *
+ * \param task Task (file in task->r0)
+ * \param node NUMA node of the thread
+ * \return int 1 if a file was taken, 0 if there are no more files
+ */
+int sched_next_file(ncd_task_t *task, int node)
+{
+	unsigned long k;
+
+	if (!queue_take(fqueues, node, &k)) {
+		return (0);
+	}
+	task->r0   = fileorder[k];
+	task->nr   = 1;
+	task->c0   = 0;
+	task->nc   = 0;
+	task->cost = ncd_files[task->r0].fsize;
+	return (1);
+}
+
+
+/**
+ * \brief Get the next files to be compressed alone
+ *
+ * Small files are taken in batches (so they can be loaded at once), the
+ * others one by one.
+ *
+ * \param tasks Tasks (file in task->r0 of each one)
+ * \param max Maximum number of files
+ * \param node NUMA node of the thread
+ * \return int Number of files taken, 0 if there are no more files
+ */
+int sched_next_files(ncd_task_t *tasks, int max, int node)
+{
+	unsigned long next, cnt, k;
+	sched_queue_t *q;
+	int i;
+
+	for (i = 0; i < nqueues; i++) {
+		q    = &fqueues[(node + i) % nqueues];
+		next = atomic_load(&q->next);
+		while (next < q->end) {
+			cnt = 1;
+			if (ncd_files[fileorder[next]].fsize <= NCD_SMALL_FILE) {
+				cnt = ((q->end - next) < (unsigned long)max ? (q->end - next) : (unsigned long)max);
+			}
+			if (atomic_compare_exchange_weak(&q->next, &next, next + cnt)) {
+				for (k = 0; k < cnt; k++) {
+					tasks[k].r0   = fileorder[next + k];
+					tasks[k].nr   = 1;
+					tasks[k].c0   = 0;
+					tasks[k].nc   = 0;
+					tasks[k].cost = ncd_files[tasks[k].r0].fsize;
+				}
+				return ((int)cnt);
+			}
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Return a task index ahead in the queues (without taking it)
+ *
+ * \param q Queues
+ * \param node Queue of the thread (NUMA node)
+ * \param ahead Number of tasks to skip
+ * \param k Task index
+ * \return int 1 if there is such task, 0 otherwise
+ */
+static int queue_peek(sched_queue_t *q, int node, unsigned long ahead, unsigned long *k)
+{
+	unsigned long next;
+	int i, n;
+
+	for (i = 0; i < nqueues; i++) {
+		n    = (node + i) % nqueues;
+		next = atomic_load(&q[n].next);
+		if (next < q[n].end) {
+			if (ahead < (q[n].end - next)) {
+				*k = next + ahead;
+				return (1);
+			}
+			ahead -= (q[n].end - next);
+		}
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Get a matrix task from its index
+ *
+ * \param k Task index
+ * \param task Task (matrix tile)
+ */
+static void get_task(unsigned long k, ncd_task_t *task)
+{
+	unsigned long rows, ncb;
+
+	rows = sched_opts->tile_rows;
+
+	switch (sched_opts->task) {
+		case NCD_TASK_TILE:
+			ncb      = total_colblocks;
+			task->r0 = roworder[k / ncb];
+			task->c0 = colblocks[k % ncb];
+			task->nc = colblocks[(k % ncb) + 1] - task->c0;
+			break;
+		case NCD_TASK_PAIR:
+			ncb      = ncd_total_files - first_col;
+			task->r0 = roworder[k / ncb];
+			task->c0 = first_col + k % ncb;
+			task->nc = 1;
+			rows     = 1;
+			break;
+		case NCD_TASK_ROW:
+		default:
+			*task = tasks[k];
+			return;
+	}
+	task->nr   = ((task->r0 + rows) > total_rows ? total_rows - task->r0 : rows);
+	task->cost = tile_cost(task->r0, task->nr, task->c0, task->nc);
+}
+
+
+/**
+ * \brief Get the next matrix task to work on
+ *
+ * \param task Task (matrix tile)
+ * \param node NUMA node of the thread
+ * \return int 1 if a task was taken, 0 if there are no more tasks
+ */
+int sched_next(ncd_task_t *task, int node)
+{
+	unsigned long k;
+
+	if (total_tasks == 0 || !queue_take(queues, node, &k)) {
+		return (0);
+	}
+	get_task(k, task);
+	return (1);
+}
+
+
+/**
+ * \brief Look at a task which will be taken later (to prefetch its files)
+ *
+ * \param task Task (matrix tile, or file in task->r0 during the first phase)
+ * \param node NUMA node of the thread
+ * \param ahead Number of tasks ahead in the queues
+ * \return int 1 if there is such task, 0 otherwise
+ */
+int sched_peek(ncd_task_t *task, int node, unsigned long ahead)
+{
+	unsigned long k;
+
+	if (queue_peek(fqueues, node, ahead, &k)) {
+		task->r0 = fileorder[k];
+		task->nr = 1;
+		task->c0 = 0;
+		task->nc = 0;
+		return (1);
+	} else if (total_tasks == 0 || !queue_peek(queues, node, ahead, &k)) {
+		return (0);
+	}
+	get_task(k, task);
+	return (1);
+}
+
+
+/**
+ * \brief Account a finished task to the measured throughput
+ *
+ * \param task Finished task
+ * \param start Time when the task was started (CLOCK_MONOTONIC)
+ * \param node NUMA node of the thread
+ */
+void sched_done(ncd_task_t *task, struct timespec *start, int node)
+{
+	struct timespec now;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+	atomic_fetch_add(&done_cost[node], task->cost);
+	atomic_fetch_add(&done_nsecs[node], (ns > 0 ? ns : 0));
+}
+
+
+/**
+ * \brief Return measured throughput of a NUMA node
+ *
+ * \param node NUMA node
+ * \return double Throughput (in MB/s of estimated cost per thread)
+ */
+double sched_throughput(int node)
+{
+	unsigned long long ns = atomic_load(&done_nsecs[node]);
+
+	if (ns == 0) {
+		return (0);
+	}
+	return (((double)atomic_load(&done_cost[node]) / (1 << 20)) / ((double)ns / 1e9));
+}
+
+
+/**
+ * \brief Give idle threads back to the scheduler
+ *
+ * \param n Number of threads with no more tasks to do
+ */
+void sched_idle(int n)
+{
+	atomic_fetch_add(&idle_threads, n);
+}
+
+
+/**
+ * \brief Borrow idle threads to work on the current task
+ *
+ * \param max Maximum number of threads
+ * \return int Number of threads borrowed (to be given back with sched_giveback())
+ * \note Threads are only lent while their compressor states fit in the
+ *       memory budget. Each borrowed thread runs one job at a time (see
+ *       sched_lend()), on its own CPU and NUMA node.
+ */
+int sched_borrow(int max)
+{
+	int cur, take = 0, fit;
+
+	cur = atomic_load(&idle_threads);
+	while (cur > 0 && max > 0) {
+		take = (cur < max ? cur : max);
+		if (atomic_compare_exchange_weak(&idle_threads, &cur, cur - take)) {
+			break;
+		}
+	}
+	if (cur <= 0 || max <= 0) {
+		return (0);
+	} else if (mem_limit == 0) {
+		return (take);
+	}
+
+	/* Each borrowed thread needs its own compressor state */
+	pthread_mutex_lock(&mem_mutex);
+	fit = 0;
+	if (mem_used < mem_limit && mem_ctx > 0) {
+		fit = (int)((mem_limit - mem_used) / mem_ctx);
+	}
+	fit       = (fit < take ? fit : take);
+	mem_used += fit * mem_ctx;
+	pthread_mutex_unlock(&mem_mutex);
+	atomic_fetch_add(&idle_threads, take - fit);
+	return (fit);
+}
+
+
+/**
+ * \brief Give borrowed threads back (see sched_borrow())
+ *
+ * \param n Number of threads
+ */
+void sched_giveback(int n)
+{
+	sched_idle(n);
+	if (n > 0) {
+		sched_release(n * mem_ctx);
+	}
+}
+
+
+/**
+ * \brief Give a job to the borrowed threads (see sched_borrow())
+ *
+ * \param job Job (it must stay valid until sched_join())
+ * \param fn Function to run
+ * \param arg Argument of the function
+ */
+void sched_lend(sched_job_t *job, void *(*fn)(void*), void *arg)
+{
+	job->fn   = fn;
+	job->arg  = arg;
+	job->done = 0;
+	job->next = NULL;
+
+	pthread_mutex_lock(&job_mutex);
+	if (job_tail != NULL) {
+		job_tail->next = job;
+	} else {
+		job_head = job;
+	}
+	job_tail = job;
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+
+/**
+ * \brief Wait for a job given with sched_lend() to be done
+ *
+ * \param job Job
+ */
+void sched_join(sched_job_t *job)
+{
+	pthread_mutex_lock(&job_mutex);
+	while (!job->done) {
+		pthread_cond_wait(&jobdone_cond, &job_mutex);
+	}
+	pthread_mutex_unlock(&job_mutex);
+}
+
+
+/**
+ * \brief Lend the calling thread, which has no more tasks to take
+ *
+ * The thread becomes idle and runs the jobs of the threads which borrow
+ * it, keeping its CPU (and NUMA node). It returns when all threads are
+ * idle, so no more jobs can be given.
+ */
+void sched_help(void)
+{
+	sched_job_t *job;
+
+	pthread_mutex_lock(&job_mutex);
+	active_threads--;
+	sched_idle(1);
+	while (1) {
+		while (job_head == NULL && active_threads > 0) {
+			pthread_cond_wait(&job_cond, &job_mutex);
+		}
+		if ((job = job_head) == NULL) {
+			break;
+		}
+		job_head = job->next;
+		if (job_head == NULL) {
+			job_tail = NULL;
+		}
+		pthread_mutex_unlock(&job_mutex);
+
+		job->fn(job->arg);
+
+		pthread_mutex_lock(&job_mutex);
+		job->done = 1;
+		pthread_cond_broadcast(&jobdone_cond);
+	}
+
+	/* Wake up the other idle threads to leave */
+	pthread_cond_broadcast(&job_cond);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+
+/**
+ * \brief Reserve memory for a task, waiting while it doesn't fit in the budget
+ *
+ * A task is delayed until running tasks release enough memory. It's never
+ * refused: a task larger than the whole budget runs alone.
+ *
+ * \param bytes Memory used by the task (mapped files and compressor states)
+ */
+void sched_reserve(size_t bytes)
+{
+	if (mem_limit == 0) {
+		return;
+	}
+	pthread_mutex_lock(&mem_mutex);
+	while (mem_used > 0 && (mem_used + bytes) > mem_limit) {
+		pthread_cond_wait(&mem_cond, &mem_mutex);
+	}
+	mem_used += bytes;
+	pthread_mutex_unlock(&mem_mutex);
+}
+
+
+/**
+ * \brief Release memory reserved with sched_reserve()
+ *
+ * \param bytes Memory reserved
+ */
+void sched_release(size_t bytes)
+{
+	if (mem_limit == 0) {
+		return;
+	}
+	pthread_mutex_lock(&mem_mutex);
+	mem_used -= bytes;
+	pthread_cond_broadcast(&mem_cond);
+	pthread_mutex_unlock(&mem_mutex);
+}
+
+
+/**
+ * \brief Release scheduler memory
+ */
+void sched_free(void)
+{
+	free(tasks);
+	free(roworder);
+	free(rowcost);
+	free(fileorder);
+	free(queues);
+	free(fqueues);
+	free(done_cost);
+	free(done_nsecs);
+	free(colblocks);
+	free(fsum);
+	tasks     = NULL;
+	roworder  = NULL;
+	rowcost   = NULL;
+	fileorder = NULL;
+	queues    = NULL;
+	fqueues   = NULL;
+	colblocks = NULL;
+	done_cost  = NULL;
+	done_nsecs = NULL;
+	fsum      = NULL;
+}
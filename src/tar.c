@@ -0,0 +1,355 @@
+/* ncd - Calculate NCD as fast as possible
+ * Copyright (C) 2018  Rene de Souza Pinto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ncd.h"
+
+/** Size of tar blocks (headers and data are aligned to them) */
+#define TAR_BLOCK 512
+
+/* Fields of a tar (ustar) header: offset and length */
+#define TAR_NAME     0
+#define TAR_NAME_LEN 100
+#define TAR_SIZE     124
+#define TAR_SIZE_LEN 12
+#define TAR_CHKSUM   148
+#define TAR_CHKSUM_LEN 8
+#define TAR_TYPE     156
+#define TAR_MAGIC    257
+#define TAR_PREFIX   345
+#define TAR_PREFIX_LEN 155
+
+/** Mapped archive */
+static unsigned char *tar_map = NULL;
+static size_t tar_len = 0;
+
+
+/**
+ * \brief Parse a numeric field (octal, or base-256 for large values)
+ *
+ * \param f Field
+ * \param len Field length
+ * \param val Returns the value
+ * \return int 0 on success, -1 if the value is negative or overflows
+ */
+static int tar_number(const unsigned char *f, int len, size_t *val)
+{
+	int i;
+
+	*val = 0;
+	if (f[0] & 0x80) {
+		/* GNU base-256 (big endian, first byte without its flag) */
+		if (f[0] & 0x40) {
+			return (-1);
+		}
+		*val = f[0] & 0x3f;
+		for (i = 1; i < len; i++) {
+			if (*val > (SIZE_MAX >> 8)) {
+				return (-1);
+			}
+			*val = (*val << 8) | f[i];
+		}
+		return (0);
+	}
+	for (i = 0; i < len && (f[i] == ' ' || f[i] == '\0'); i++);
+	for (; i < len && f[i] >= '0' && f[i] <= '7'; i++) {
+		if (*val > (SIZE_MAX >> 3)) {
+			return (-1);
+		}
+		*val = (*val << 3) | (f[i] - '0');
+	}
+	return (0);
+}
+
+
+/**
+ * \brief Parse a decimal value (of a pax record)
+ *
+ * \param s Value (not null terminated)
+ * \param len Value length
+ * \param val Returns the value
+ * \return int 0 on success, -1 if the value is invalid or overflows
+ */
+static int tar_decimal(const char *s, size_t len, size_t *val)
+{
+	size_t i;
+
+	*val = 0;
+	for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+		if (*val > (SIZE_MAX - (s[i] - '0')) / 10) {
+			return (-1);
+		}
+		*val = 10 * (*val) + (s[i] - '0');
+	}
+	return ((len > 0 && i == len) ? 0 : -1);
+}
+
+
+/**
+ * \brief Check the header checksum
+ *
+ * \return int 1 if valid, 0 otherwise
+ */
+static int tar_checksum(const unsigned char *h)
+{
+	size_t sum = 0, chksum;
+	int i;
+
+	for (i = 0; i < TAR_BLOCK; i++) {
+		sum += ((i >= TAR_CHKSUM && i < TAR_CHKSUM + TAR_CHKSUM_LEN) ? ' ' : h[i]);
+	}
+	return (tar_number(&h[TAR_CHKSUM], TAR_CHKSUM_LEN, &chksum) == 0 && sum == chksum);
+}
+
+
+/**
+ * \brief Find a record of a pax extended header
+ *
+ * \param data Extended header ("LEN KEY=VALUE\n" records)
+ * \param len Length of the extended header
+ * \param key Key
+ * \param vlen Returns the value length
+ * \return const char* Value (not null terminated), NULL if not found
+ */
+static const char *tar_pax(const char *data, size_t len, const char *key, size_t *vlen)
+{
+	size_t pos, rlen, klen = strlen(key);
+	const char *rec, *kv;
+
+	for (pos = 0; pos < len; pos += rlen) {
+		/* Record length (the record can't go past the header) */
+		rec = &data[pos];
+		for (kv = rec, rlen = 0; kv < &data[len] && *kv >= '0' && *kv <= '9'; kv++) {
+			rlen = 10 * rlen + (*kv - '0');
+			if (rlen > len - pos) {
+				return (NULL);
+			}
+		}
+		if (kv == &data[len] || *kv != ' ' || (size_t)(kv - rec) + 1 >= rlen) {
+			break;
+		}
+		kv++;
+		if ((size_t)(&rec[rlen] - kv) > klen + 1 &&
+				strncmp(kv, key, klen) == 0 && kv[klen] == '=') {
+			*vlen = &rec[rlen - 1] - &kv[klen + 1];
+			return (&kv[klen + 1]);
+		}
+	}
+	return (NULL);
+}
+
+
+/**
+ * \brief Check whether a member passes the filters
+ *
+ * \return int 1 if the member should be used, 0 otherwise
+ */
+static int tar_filter(ncd_opts_t *opts, const char *name, size_t size)
+{
+	int i, inc = (opts->n_include == 0);
+
+	for (i = 0; i < opts->n_exclude; i++) {
+		if (fnmatch(opts->exclude[i], name, 0) == 0) {
+			return (0);
+		}
+	}
+	for (i = 0; i < opts->n_include && !inc; i++) {
+		inc = (fnmatch(opts->include[i], name, 0) == 0);
+	}
+	return (inc && size >= opts->min_size && (opts->max_size == 0 || size <= opts->max_size));
+}
+
+
+/**
+ * \brief List the regular files (members) of an uncompressed tar archive
+ *
+ * The archive is mapped once and its headers are indexed: the contents of
+ * each file point to its slice of the mapping, so nothing is extracted and
+ * no member is opened. Files are labeled by their member names and keep
+ * the archive order. Long names (GNU and pax) and pax sizes are supported.
+ * Filters apply as in list mode (globs are matched against the whole member
+ * name).
+ *
+ * \param path Archive
+ * \param files Returns the list of files (allocated with malloc())
+ * \param opts Options (filters)
+ * \return long Number of files, -1 on error
+ */
+long scan_tar(char *path, file_t **files, ncd_opts_t *opts)
+{
+	unsigned long n, max, k;
+	size_t pos, size, psize, nlen, vlen;
+	const char *lname, *val;
+	unsigned char *h;
+	file_t *list, *nlist;
+	struct stat st;
+	char *name;
+	int fd, ret, has_psize;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0) close(fd);
+		return (-1);
+	}
+	tar_len = st.st_size;
+	tar_map = (tar_len > 0 ? (unsigned char*)mmap(NULL, tar_len, PROT_READ, MAP_SHARED, fd, 0) : NULL);
+	close(fd);
+	if (tar_map == (unsigned char*)MAP_FAILED || tar_map == NULL) {
+		perror(path);
+		tar_map = NULL;
+		tar_len = 0;
+		return (-1);
+	}
+	madvise(tar_map, tar_len, MADV_SEQUENTIAL);
+
+	list  = NULL;
+	n     = max = 0;
+	ret   = 0;
+	lname = NULL;
+	nlen  = 0;
+	psize = 0;
+	has_psize = 0;
+	for (pos = 0; pos + TAR_BLOCK <= tar_len; pos += TAR_BLOCK + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK) {
+		h    = &tar_map[pos];
+		size = 0;
+		if (h[0] == '\0') {
+			/* End of archive */
+			break;
+		} else if (!tar_checksum(h)) {
+			fprintf(stderr, "%s: invalid tar header at offset %zu\n", path, pos);
+			ret = -1;
+			break;
+		}
+		/* Size (a pax size overrides the one of the header) */
+		if (has_psize) {
+			size      = psize;
+			has_psize = 0;
+		} else if (tar_number(&h[TAR_SIZE], TAR_SIZE_LEN, &size) < 0) {
+			size = SIZE_MAX;
+		}
+		if (size > tar_len - pos - TAR_BLOCK) {
+			fprintf(stderr, "%s: invalid member size at offset %zu (truncated archive?)\n", path, pos);
+			ret = -1;
+			break;
+		}
+
+		/* Long name (and pax size) of the next member */
+		if (h[TAR_TYPE] == 'L') {
+			lname = (const char*)&h[TAR_BLOCK];
+			nlen  = strnlen(lname, size);
+			continue;
+		} else if (h[TAR_TYPE] == 'x') {
+			if ((val = tar_pax((const char*)&h[TAR_BLOCK], size, "path", &vlen)) != NULL) {
+				lname = val;
+				nlen  = vlen;
+			}
+			if ((val = tar_pax((const char*)&h[TAR_BLOCK], size, "size", &vlen)) != NULL) {
+				if (tar_decimal(val, vlen, &psize) < 0) {
+					fprintf(stderr, "%s: invalid pax size at offset %zu\n", path, pos);
+					ret = -1;
+					break;
+				}
+				has_psize = 1;
+			}
+			continue;
+		} else if (h[TAR_TYPE] != '0' && h[TAR_TYPE] != '\0' && h[TAR_TYPE] != '7') {
+			/* Not a regular file (directory, link, global header, etc.) */
+			lname = NULL;
+			continue;
+		}
+
+		/* Member name */
+		if (lname != NULL) {
+			name = strndup(lname, nlen);
+		} else if (memcmp(&h[TAR_MAGIC], "ustar", 5) == 0 && h[TAR_PREFIX] != '\0') {
+			name = (char*)malloc(TAR_PREFIX_LEN + TAR_NAME_LEN + 2);
+			if (name != NULL) {
+				sprintf(name, "%.*s/%.*s", TAR_PREFIX_LEN, (const char*)&h[TAR_PREFIX],
+						TAR_NAME_LEN, (const char*)&h[TAR_NAME]);
+			}
+		} else {
+			name = strndup((const char*)&h[TAR_NAME], TAR_NAME_LEN);
+		}
+		lname = NULL;
+		if (name == NULL) {
+			perror("scan_tar()");
+			ret = -1;
+			break;
+		} else if (!tar_filter(opts, name, size)) {
+			free(name);
+			continue;
+		}
+
+		if (n == max) {
+			max   = (max == 0 ? 1024 : 2 * max);
+			nlist = (file_t*)realloc(list, sizeof(file_t) * max);
+			if (nlist == NULL) {
+				perror("scan_tar()");
+				free(name);
+				ret = -1;
+				break;
+			}
+			list = nlist;
+		}
+		list[n].path  = name;
+		list[n].fsize = size;
+		list[n].contents = &tar_map[pos + TAR_BLOCK];
+		n++;
+	}
+
+	if (ret < 0) {
+		for (k = 0; k < n; k++) {
+			free(list[k].path);
+		}
+		free(list);
+		ncd_tar_free();
+		return (-1);
+	}
+
+	/* Contents stay in the mapping for the whole run (even empty members,
+	 * which have no file to be opened) */
+	for (k = 0; k < n; k++) {
+		h = list[k].contents;
+		ncd_file_init(&list[k], list[k].path, list[k].fsize);
+		list[k].label    = list[k].path;
+		list[k].contents = h;
+		list[k].packed   = NCD_PACKED_TAR;
+	}
+	*files = (list != NULL ? list : (file_t*)malloc(sizeof(file_t)));
+	return ((long)n);
+}
+
+
+/**
+ * \brief Unmap the archive
+ */
+void ncd_tar_free(void)
+{
+	if (tar_map != NULL) {
+		munmap(tar_map, tar_len);
+	}
+	tar_map = NULL;
+	tar_len = 0;
+}
@@ -0,0 +1,436 @@
+/* ncd - Calculate NCD as fast as possible
+ * Copyright (C) 2018  Rene de Souza Pinto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ncd.h"
+
+/** Path of NUMA nodes information */
+#define TOPO_SYSFS_NODE "/sys/devices/system/node"
+/** Maximum number of NUMA nodes */
+#define TOPO_MAX_NODES  256
+/** Mount point of cgroups (v2, or one directory per controller on v1) */
+#define TOPO_CGROUP     "/sys/fs/cgroup"
+
+/** Number of NUMA nodes in use */
+static int topo_nnodes = 1;
+/** NUMA node of each thread */
+static int *thread_node = NULL;
+/** CPU of each thread (-1 for not pinned) */
+static int *thread_cpu = NULL;
+
+
+/**
+ * \brief Read a list of numbers ("0-3,8,10-11") from a file
+ *
+ * \param path File path
+ * \param list Output list
+ * \param max Maximum number of entries
+ * \return int Number of entries read, -1 on error
+ */
+static int topo_read_list(const char *path, int *list, int max)
+{
+	FILE *fp;
+	int n, a, b, c;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return (-1);
+	}
+
+	n = 0;
+	while (fscanf(fp, "%d", &a) == 1) {
+		b = a;
+		c = fgetc(fp);
+		if (c == '-') {
+			if (fscanf(fp, "%d", &b) != 1) {
+				break;
+			}
+			c = fgetc(fp);
+		}
+		for (; a <= b && n < max; a++) {
+			list[n++] = a;
+		}
+		if (c != ',') {
+			break;
+		}
+	}
+
+	fclose(fp);
+	return (n);
+}
+
+
+/**
+ * \brief Find NUMA nodes and assign a node (and a CPU) to each thread
+ *
+ * Threads are spread over the nodes (round robin) and, within each node,
+ * over its CPUs. Only CPUs allowed to the process are used.
+ *
+ * \param n_threads Number of threads
+ * \param pin Pin threads to CPUs (when 0, all threads are on node 0)
+ * \return int 0 on success, -1 otherwise (errors are reported on stderr)
+ */
+int topo_init(int n_threads, char pin)
+{
+	static int nodes[TOPO_MAX_NODES], cpus[CPU_SETSIZE];
+	int i, n, c, nn, ncpus, *nodecpus, *nodefirst, *nodecnt;
+	char path[64];
+	cpu_set_t mask;
+
+	topo_nnodes = 1;
+	thread_node = (int*)calloc(n_threads, sizeof(int));
+	thread_cpu  = (int*)malloc(sizeof(int) * n_threads);
+	if (thread_node == NULL || thread_cpu == NULL) {
+		perror("topo_init()");
+		topo_free();
+		return (-1);
+	}
+	for (i = 0; i < n_threads; i++) {
+		thread_cpu[i] = -1;
+	}
+	if (!pin) {
+		/* No pinning: the CPUs allowed to the process aren't needed */
+		return (0);
+	}
+
+	CPU_ZERO(&mask);
+	if (sched_getaffinity(0, sizeof(mask), &mask) < 0) {
+		perror("sched_getaffinity()");
+		topo_free();
+		return (-1);
+	}
+
+	/* CPUs of each node (grouped), without the ones we can't use */
+	nodecpus  = (int*)malloc(sizeof(int) * CPU_SETSIZE);
+	nodefirst = (int*)malloc(sizeof(int) * (TOPO_MAX_NODES + 1));
+	nodecnt   = (int*)malloc(sizeof(int) * (TOPO_MAX_NODES + 1));
+	if (nodecpus == NULL || nodefirst == NULL || nodecnt == NULL) {
+		perror("topo_init()");
+		free(nodecpus); free(nodefirst); free(nodecnt);
+		topo_free();
+		return (-1);
+	}
+
+	nn    = topo_read_list(TOPO_SYSFS_NODE "/online", nodes, TOPO_MAX_NODES);
+	ncpus = 0;
+	topo_nnodes = 0;
+	for (i = 0; i < nn; i++) {
+		snprintf(path, sizeof(path), TOPO_SYSFS_NODE "/node%d/cpulist", nodes[i]);
+		nodefirst[topo_nnodes] = ncpus;
+		n = topo_read_list(path, cpus, CPU_SETSIZE);
+		for (c = 0; c < n; c++) {
+			if (CPU_ISSET(cpus[c], &mask)) {
+				nodecpus[ncpus++] = cpus[c];
+			}
+		}
+		nodecnt[topo_nnodes] = ncpus - nodefirst[topo_nnodes];
+		if (nodecnt[topo_nnodes] > 0) {
+			topo_nnodes++;
+		}
+	}
+	if (topo_nnodes == 0) {
+		/* No NUMA information: single node with all our CPUs */
+		nodefirst[0] = 0;
+		ncpus        = 0;
+		for (c = 0; c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &mask)) {
+				nodecpus[ncpus++] = c;
+			}
+		}
+		nodecnt[0]  = ncpus;
+		topo_nnodes = 1;
+	}
+
+	/* Assign threads */
+	for (i = 0; i < n_threads; i++) {
+		n = i % topo_nnodes;
+		thread_node[i] = n;
+		thread_cpu[i]  = (nodecnt[n] > 0 ?
+				nodecpus[nodefirst[n] + (i / topo_nnodes) % nodecnt[n]] : -1);
+	}
+
+	free(nodecpus);
+	free(nodefirst);
+	free(nodecnt);
+	return (0);
+}
+
+
+/**
+ * \brief Pin the calling thread to its CPU
+ *
+ * \param tid Thread index
+ * \return int 0 on success (or not pinned), -1 otherwise
+ * \note Memory first touched by the thread after this call (compressor
+ *       states, pages of the files it maps) is allocated on its node
+ */
+int topo_bind(int tid)
+{
+	cpu_set_t mask;
+
+	if (thread_cpu == NULL || thread_cpu[tid] < 0) {
+		return (0);
+	}
+	CPU_ZERO(&mask);
+	CPU_SET(thread_cpu[tid], &mask);
+	return (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0 ? 0 : -1);
+}
+
+
+/**
+ * \brief Return the NUMA node of a thread
+ */
+int topo_node(int tid)
+{
+	return (thread_node != NULL ? thread_node[tid] : 0);
+}
+
+
+/**
+ * \brief Return the CPU of a thread (-1 for not pinned)
+ */
+int topo_cpu(int tid)
+{
+	return (thread_cpu != NULL ? thread_cpu[tid] : -1);
+}
+
+
+/**
+ * \brief Return the number of NUMA nodes in use
+ */
+int topo_nodes(void)
+{
+	return (topo_nnodes);
+}
+
+
+/**
+ * \brief Open a cgroup file of the process
+ *
+ * The file is looked up in the cgroup of the process first and then in the
+ * root of the hierarchy (which is the cgroup itself inside containers).
+ *
+ * \param ctrl Controller (cgroup v1), or NULL for cgroup v2
+ * \param file File name
+ * \return FILE* Opened file, NULL if not found
+ */
+static FILE *topo_cgroup_open(const char *ctrl, const char *file)
+{
+	char line[512], path[1024], *ctrls, *cgpath, *tok, *save;
+	FILE *fp, *cg;
+
+	cg = fopen("/proc/self/cgroup", "r");
+	while (cg != NULL && fgets(line, sizeof(line), cg) != NULL) {
+		/* Lines are "id:controllers:path" */
+		line[strcspn(line, "\n")] = '\0';
+		if ((ctrls = strchr(line, ':')) == NULL ||
+				(cgpath = strchr(++ctrls, ':')) == NULL) {
+			continue;
+		}
+		*cgpath++ = '\0';
+		if (ctrl == NULL && *ctrls == '\0') {
+			snprintf(path, sizeof(path), TOPO_CGROUP "%s/%s", cgpath, file);
+		} else if (ctrl != NULL && *ctrls != '\0') {
+			snprintf(path, sizeof(path), TOPO_CGROUP "/%s%s/%s", ctrls, cgpath, file);
+			for (tok = strtok_r(ctrls, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+				if (strcmp(tok, ctrl) == 0) {
+					break;
+				}
+			}
+			if (tok == NULL) {
+				continue;
+			}
+		} else {
+			continue;
+		}
+		if ((fp = fopen(path, "r")) != NULL) {
+			fclose(cg);
+			return (fp);
+		}
+	}
+	if (cg != NULL) {
+		fclose(cg);
+	}
+
+	if (ctrl == NULL) {
+		snprintf(path, sizeof(path), TOPO_CGROUP "/%s", file);
+	} else {
+		snprintf(path, sizeof(path), TOPO_CGROUP "/%s/%s", ctrl, file);
+	}
+	return (fopen(path, "r"));
+}
+
+
+/**
+ * \brief Read a number from a cgroup file
+ *
+ * \param ctrl Controller (cgroup v1), or NULL for cgroup v2
+ * \param file File name
+ * \return long long Value, -1 if not found or unlimited ("max")
+ */
+static long long topo_cgroup_read(const char *ctrl, const char *file)
+{
+	long long value = -1;
+	FILE *fp;
+
+	if ((fp = topo_cgroup_open(ctrl, file)) != NULL) {
+		if (fscanf(fp, "%lld", &value) != 1) {
+			value = -1;
+		}
+		fclose(fp);
+	}
+	return (value);
+}
+
+
+/**
+ * \brief Return the CPU quota (in CPUs, rounded up) of the process cgroup
+ *
+ * \return int CPU quota, 0 for no quota
+ */
+static int topo_cpu_quota(void)
+{
+	long long quota, period;
+	char buf[32];
+	FILE *fp;
+
+	/* cgroup v2: "quota period" or "max period" */
+	quota = period = -1;
+	if ((fp = topo_cgroup_open(NULL, "cpu.max")) != NULL) {
+		if (fscanf(fp, "%31s %lld", buf, &period) == 2 && strcmp(buf, "max") != 0) {
+			quota = atoll(buf);
+		}
+		fclose(fp);
+	} else {
+		/* cgroup v1 */
+		quota  = topo_cgroup_read("cpu", "cpu.cfs_quota_us");
+		period = topo_cgroup_read("cpu", "cpu.cfs_period_us");
+	}
+
+	if (quota <= 0 || period <= 0) {
+		return (0);
+	}
+	return ((int)((quota + period - 1) / period));
+}
+
+
+/**
+ * \brief Return the memory available to the process (system and cgroup)
+ *
+ * \return long long Available memory (in bytes), -1 if unknown
+ */
+static long long topo_mem_avail(void)
+{
+	long long avail, total, limit, usage;
+	char line[128];
+	FILE *fp;
+
+	avail = total = -1;
+	if ((fp = fopen("/proc/meminfo", "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			sscanf(line, "MemTotal: %lld", &total);
+			sscanf(line, "MemAvailable: %lld", &avail);
+		}
+		fclose(fp);
+		avail = (avail > 0 ? avail << 10 : -1);
+		total = (total > 0 ? total << 10 : -1);
+	}
+
+	/* cgroup v2 first, then v1 (where no limit is a huge number) */
+	limit = topo_cgroup_read(NULL, "memory.max");
+	usage = topo_cgroup_read(NULL, "memory.current");
+	if (limit < 0) {
+		limit = topo_cgroup_read("memory", "memory.limit_in_bytes");
+		usage = topo_cgroup_read("memory", "memory.usage_in_bytes");
+	}
+	if (limit > 0 && (total < 0 || limit < total)) {
+		limit -= (usage > 0 && usage < limit ? usage : 0);
+		if (avail < 0 || limit < avail) {
+			avail = limit;
+		}
+	}
+	return (avail);
+}
+
+
+/**
+ * \brief Choose the number of threads for this machine (or container)
+ *
+ * Use one thread for each CPU the process can run on, limited by the CPU
+ * quota of its cgroup and by the available memory for compressor contexts.
+ *
+ * \param ctxmem Memory used by each compressor context (each thread)
+ * \param verbose Report the decision on stderr
+ * \return int Number of threads
+ */
+int topo_threads(size_t ctxmem, char verbose)
+{
+	int ncpus, quota, n;
+	long long mem;
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+		ncpus = CPU_COUNT(&mask);
+	} else {
+		ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	ncpus = (ncpus > 0 ? ncpus : 1);
+	quota = topo_cpu_quota();
+	mem   = topo_mem_avail();
+
+	n = ncpus;
+	if (quota > 0 && quota < n) {
+		n = quota;
+	}
+	if (mem > 0 && ctxmem > 0 && (long long)(mem / ctxmem) < n) {
+		n = (int)(mem / ctxmem);
+	}
+	n = (n > 0 ? n : 1);
+
+	if (verbose) {
+		fprintf(stderr, "Threads: %d (CPUs: %d, CPU quota: ", n, ncpus);
+		if (quota > 0) {
+			fprintf(stderr, "%d", quota);
+		} else {
+			fprintf(stderr, "none");
+		}
+		if (mem > 0) {
+			fprintf(stderr, ", available memory: %lld MB", mem >> 20);
+		}
+		fprintf(stderr, ", memory per thread: %zu MB)\n", (ctxmem + (1 << 20) - 1) >> 20);
+	}
+	return (n);
+}
+
+
+/**
+ * \brief Release topology information
+ */
+void topo_free(void)
+{
+	free(thread_node);
+	free(thread_cpu);
+	thread_node = NULL;
+	thread_cpu  = NULL;
+	topo_nnodes = 1;
+}
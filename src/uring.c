@@ -0,0 +1,376 @@
+/* ncd - Calculate NCD as fast as possible
+ * Copyright (C) 2018  Rene de Souza Pinto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "ncd.h"
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+
+/** Number of entries of each ring (an open, a read and a close per file) */
+#define URING_ENTRIES (2 * NCD_LOAD_BATCH)
+
+/** io_uring instance (raw system calls, no liburing) */
+typedef struct _uring_t {
+	/** Ring file descriptor */
+	int fd;
+	/** Submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	/** Completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	/** Submission entries */
+	struct io_uring_sqe *sqes;
+	/** Completion entries */
+	struct io_uring_cqe *cqes;
+	/** Mapped rings */
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	/** Local tail of the submission queue */
+	unsigned tail;
+} uring_t;
+
+/** Ring of each thread (io_uring is not available when it's (void*)-1) */
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+
+/**
+ * \brief Release a ring
+ */
+static void uring_free(void *ring)
+{
+	uring_t *r = (uring_t*)ring;
+
+	if (r == NULL || r == (uring_t*)-1) {
+		return;
+	}
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+		munmap(r->sqes, r->sqes_len);
+	}
+	if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+		munmap(r->cq_ptr, r->cq_len);
+	}
+	if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) {
+		munmap(r->sq_ptr, r->sq_len);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+	free(r);
+}
+
+
+static void uring_create_key(void)
+{
+	pthread_key_create(&ringKey, uring_free);
+}
+
+
+/**
+ * \brief Return the ring of the calling thread (create it if necessary)
+ *
+ * \return uring_t* Ring, NULL if io_uring is not available
+ */
+static uring_t *uring_get(void)
+{
+	struct io_uring_params p;
+	uring_t *r;
+	char *sq;
+
+	pthread_once(&ringKeyOnce, uring_create_key);
+	r = (uring_t*)pthread_getspecific(ringKey);
+	if (r == (uring_t*)-1) {
+		return (NULL);
+	} else if (r != NULL) {
+		return (r);
+	}
+
+	r = (uring_t*)calloc(1, sizeof(uring_t));
+	memset(&p, 0, sizeof(p));
+	if (r == NULL || (r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+		/* Not supported (or disabled) by the kernel */
+		free(r);
+		pthread_setspecific(ringKey, (void*)-1);
+		return (NULL);
+	}
+
+	r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->sq_len = r->cq_len = (r->sq_len > r->cq_len ? r->sq_len : r->cq_len);
+	}
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		r->cq_ptr = r->sq_ptr;
+	} else if (r->sq_ptr != MAP_FAILED) {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	}
+	if (r->sq_ptr != MAP_FAILED && r->cq_ptr != MAP_FAILED) {
+		r->sqes = (struct io_uring_sqe*)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	}
+	if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+			r->sqes == NULL || r->sqes == MAP_FAILED) {
+		uring_free(r);
+		pthread_setspecific(ringKey, (void*)-1);
+		return (NULL);
+	}
+
+	sq          = (char*)r->sq_ptr;
+	r->sq_head  = (unsigned*)(sq + p.sq_off.head);
+	r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq + p.sq_off.array);
+	r->cq_head  = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+	r->cq_tail  = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask  = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+	r->tail     = *r->sq_tail;
+	pthread_setspecific(ringKey, r);
+	return (r);
+}
+
+
+/**
+ * \brief Get a (cleared) submission entry
+ */
+static struct io_uring_sqe *uring_sqe(uring_t *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	idx = r->tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[idx] = idx;
+	r->tail++;
+	return (sqe);
+}
+
+
+/**
+ * \brief Submit all pending entries and wait for their completions
+ *
+ * On failure, the entries which were not submitted are withdrawn, and the
+ * others are still waited for (their buffers and descriptors are in use
+ * until they complete), so no completion is left for the next batch.
+ *
+ * \param r Ring
+ * \param res Result of each entry (indexed by its user_data)
+ * \return int 0 on success, -1 if some entries were not submitted, -2 if
+ * the completions can't be waited for (the thread stops using the ring
+ * and the submitted entries may still be running)
+ */
+static int uring_run(uring_t *r, int *res)
+{
+	unsigned n, submitted, done, head;
+	struct io_uring_cqe *cqe;
+	int ret, err;
+
+	n = r->tail - *r->sq_tail;
+	atomic_store_explicit((_Atomic unsigned*)r->sq_tail, r->tail, memory_order_release);
+
+	for (submitted = 0, done = 0, err = 0; done < n; ) {
+		ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			if (submitted == n) {
+				pthread_setspecific(ringKey, (void*)-1);
+				return (-2);
+			}
+			/* Withdraw the entries which were not submitted */
+			head    = atomic_load_explicit((_Atomic unsigned*)r->sq_head, memory_order_acquire);
+			r->tail = head;
+			atomic_store_explicit((_Atomic unsigned*)r->sq_tail, head, memory_order_release);
+			n   = submitted;
+			err = -1;
+			continue;
+		} else if (ret > 0) {
+			submitted += ret;
+		}
+
+		/* Reap completions */
+		head = *r->cq_head;
+		while (head != atomic_load_explicit((_Atomic unsigned*)r->cq_tail, memory_order_acquire)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			res[cqe->user_data] = cqe->res;
+			head++;
+			done++;
+		}
+		atomic_store_explicit((_Atomic unsigned*)r->cq_head, head, memory_order_release);
+	}
+	return (err);
+}
+
+
+/**
+ * \brief Release the buffers and descriptors of a failed batch
+ *
+ * \param buf Buffers
+ * \param res Results of the batch (see ncd_load())
+ * \param n Number of files
+ * \param ret Result of uring_run()
+ */
+static void uring_abort(unsigned char **buf, int *res, unsigned long n, int ret)
+{
+	unsigned long i;
+
+	if (ret == -2) {
+		/* Entries may still write to the buffers: they are leaked */
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (buf[i] != NULL && res[i] >= 0 && res[2 * n + i] > 0) {
+			/* Opened, but its close didn't run */
+			close(res[i]);
+		}
+		free(buf[i]);
+	}
+}
+#endif
+
+
+/**
+ * \brief Read small files into memory, in batch
+ *
+ * Files are opened, read and closed with a few io_uring submissions
+ * (instead of open(), mmap(), munmap() and close() for each one). Files
+ * which are larger than NCD_SMALL_FILE, already opened or which fail to
+ * load (or don't have the expected size) are left to the usual path in
+ * ncd_open().
+ *
+ * \param files Files to load
+ * \param n Number of files (up to NCD_LOAD_BATCH)
+ * \return int Number of files loaded
+ */
+int ncd_load(file_t **files, unsigned long n)
+{
+#if HAVE_LINUX_IO_URING_H
+	struct io_uring_sqe *sqe;
+	unsigned char *buf[NCD_LOAD_BATCH];
+	int res[3 * NCD_LOAD_BATCH];
+	unsigned long i, cnt;
+	uring_t *r;
+	file_t *f;
+	int loaded, ret;
+
+	n = (n > NCD_LOAD_BATCH ? NCD_LOAD_BATCH : n);
+	for (i = 0, cnt = 0; i < n; i++) {
+		f      = files[i];
+		buf[i] = NULL;
+		if (f->fsize > NCD_SMALL_FILE || f->fsize == 0) {
+			continue;
+		}
+		/* Skip files already loaded or in use (and the busy ones) */
+		if (sem_trywait(&f->lock) < 0) {
+			continue;
+		} else if (f->contents != NULL || f->reference > 0) {
+			sem_post(&f->lock);
+			continue;
+		}
+		sem_post(&f->lock);
+		/* One more byte to find files larger than expected */
+		buf[i] = (unsigned char*)malloc(f->fsize + 1);
+		cnt   += (buf[i] != NULL);
+	}
+	if (cnt < 2 || (r = uring_get()) == NULL) {
+		/* Not worth it (or not available) */
+		for (i = 0; i < n; i++) {
+			free(buf[i]);
+		}
+		return (0);
+	}
+
+	/* Open all files (the result of a close stays 1 until it runs) */
+	for (i = 0; i < n; i++) {
+		res[i]         = -1;
+		res[2 * n + i] = 1;
+		if (buf[i] != NULL) {
+			sqe = uring_sqe(r);
+			sqe->opcode     = IORING_OP_OPENAT;
+			sqe->fd         = AT_FDCWD;
+			sqe->addr       = (unsigned long)files[i]->path;
+			sqe->open_flags = O_RDONLY;
+			sqe->user_data  = i;
+		}
+	}
+	if ((ret = uring_run(r, res)) < 0) {
+		uring_abort(buf, res, n, ret);
+		return (0);
+	}
+
+	/* Read and close them (close runs even if read fails) */
+	for (i = 0; i < n; i++) {
+		res[n + i] = -1;
+		if (buf[i] == NULL) {
+			continue;
+		} else if (res[i] < 0) {
+			free(buf[i]);
+			buf[i] = NULL;
+			continue;
+		}
+		sqe = uring_sqe(r);
+		sqe->opcode    = IORING_OP_READ;
+		sqe->fd        = res[i];
+		sqe->addr      = (unsigned long)buf[i];
+		sqe->len       = files[i]->fsize + 1;
+		sqe->off       = 0;
+		sqe->flags     = IOSQE_IO_HARDLINK;
+		sqe->user_data = n + i;
+
+		sqe = uring_sqe(r);
+		sqe->opcode    = IORING_OP_CLOSE;
+		sqe->fd        = res[i];
+		sqe->user_data = 2 * n + i;
+	}
+	if ((ret = uring_run(r, res)) < 0) {
+		uring_abort(buf, res, n, ret);
+		return (0);
+	}
+
+	/* Keep the contents of the files (unless they were opened meanwhile) */
+	loaded = 0;
+	for (i = 0; i < n; i++) {
+		f = files[i];
+		if (buf[i] == NULL) {
+			continue;
+		}
+		sem_wait(&f->lock);
+		if (res[n + i] == f->fsize && f->contents == NULL && f->reference == 0) {
+			f->contents = buf[i];
+			f->heap     = 1;
+			buf[i]      = NULL;
+			loaded++;
+		}
+		sem_post(&f->lock);
+		free(buf[i]);
+	}
+	return (loaded);
+#else
+	return (0);
+#endif
+}
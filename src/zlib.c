@@ -1,79 +1,190 @@
 #include "config.h"
 #if HAVE_ZLIB
 #include <stdio.h>
+#include <stdlib.h>
 #include <zlib.h>
 #include "ncd.h"
 
 #define Z_FILE_CHUNK   16384
+/** Maximum input given to deflate at once (avail_in is an uInt) */
+#define Z_SEGMENT_MAX  (1UL << 30)
 #define Z_COMP_LEVEL 9
 
+/** Deflate stream primed with file A (see zlib_prefix_open()) */
+typedef struct _zlib_prefix {
+	/** Stream state right before the end of file A */
+	z_stream strm;
+	/** Compressed bytes produced so far */
+	ssize_t cSize;
+} zlib_prefix_t;
+
+
 /**
- * \brief Return compressed file size using zlib
+ * \brief Deflate the remaining data of the file
  *
- * \return ssize_t Compressed size
+ * \param strm Initialized deflate stream
+ * \param fin Input file
+ * \param finish Should be 1 to finish the stream at end of file, 0 to
+ *        leave it open (with pending data) for further input
+ * \return ssize_t Number of compressed bytes produced, -1 on error
  */
-ssize_t zlib_getcompsize(ncd_file_t *fin)
+static ssize_t zlib_deflate(z_stream *strm, ncd_file_t *fin, int finish)
 {
 	int ret, flush;
-	unsigned char dIn[Z_FILE_CHUNK];
+	const unsigned char *dIn;
 	unsigned char dOut[Z_FILE_CHUNK];
 	unsigned int have;
 	ssize_t cSize;
-	z_stream strm;
-
-	/* Allocate inflate state */
-	cSize         = 0;
-	strm.zalloc   = Z_NULL;
-	strm.zfree    = Z_NULL;
-	strm.opaque   = Z_NULL;
-	ret = deflateInit(&strm, Z_COMP_LEVEL);
-	if(ret != Z_OK) {
-		ncd_err = -1;
-		return 0;
-	}
 
+	cSize = 0;
+	ret   = Z_OK;
 	do {
-		strm.avail_in = ncd_fread(dIn, 1, Z_FILE_CHUNK, fin);
+		/* Deflate straight from file contents */
+		strm->avail_in = ncd_fsegment(fin, &dIn, Z_SEGMENT_MAX);
  		if (ncd_ferror(fin)) {
-			(void)deflateEnd(&strm);
-			return 0;
+			return -1;
 		}
-		flush = ncd_feof(fin) ? Z_FINISH : Z_NO_FLUSH;
-		strm.next_in = dIn;
+		flush = (finish && ncd_feof(fin)) ? Z_FINISH : Z_NO_FLUSH;
+		strm->next_in = (unsigned char*)dIn;
 
 		do {
-			strm.avail_out = Z_FILE_CHUNK;
-			strm.next_out  = dOut;
-			ret = deflate(&strm, flush);
+			strm->avail_out = Z_FILE_CHUNK;
+			strm->next_out  = dOut;
+			ret = deflate(strm, flush);
 			/* assert state */
 			if (ret == Z_STREAM_ERROR) {
-				ncd_err = -1;
-				return 0;
+				return -1;
 			}
 
-			have   = Z_FILE_CHUNK - strm.avail_out;
+			have   = Z_FILE_CHUNK - strm->avail_out;
 			cSize += have;
-		} while (strm.avail_out == 0);
-		if(strm.avail_in != 0) {
-			ncd_err = -1;
-			return 0;
+		} while (strm->avail_out == 0);
+		if(strm->avail_in != 0) {
+			return -1;
 		}
 
-	} while(flush != Z_FINISH);
-	if(ret != Z_STREAM_END) {
+	} while(flush != Z_FINISH && !ncd_feof(fin));
+
+	if (finish && ret != Z_STREAM_END) {
+		return -1;
+	}
+	return cSize;
+}
+
+
+/**
+ * \brief Return compressed file size using zlib
+ *
+ * \return ssize_t Compressed size
+ */
+ssize_t zlib_getcompsize(ncd_file_t *fin)
+{
+	int ret;
+	ssize_t cSize;
+	z_stream strm;
+
+	/* Allocate inflate state */
+	strm.zalloc   = Z_NULL;
+	strm.zfree    = Z_NULL;
+	strm.opaque   = Z_NULL;
+	ret = deflateInit(&strm, Z_COMP_LEVEL);
+	if(ret != Z_OK) {
 		ncd_err = -1;
 		return 0;
 	}
 
+	cSize = zlib_deflate(&strm, fin, 1);
+
 	/* Clean up */
-    (void)deflateEnd(&strm);
+	(void)deflateEnd(&strm);
 
 	/* Return */
-	if (ret != Z_STREAM_END) {
-		return -1;
+	if (cSize < 0) {
+		ncd_err = -1;
+		return 0;
 	} else {
 		return cSize;
 	}
 }
+
+
+/**
+ * \brief Deflate file A and keep the stream state for further A+B compressions
+ *
+ * \param fin File A
+ * \return void* Primed state, NULL on error
+ */
+void *zlib_prefix_open(ncd_file_t *fin)
+{
+	zlib_prefix_t *pf;
+
+	pf = (zlib_prefix_t*)malloc(sizeof(zlib_prefix_t));
+	if (pf == NULL || ncd_fseek(fin, 0, SEEK_SET) < 0) {
+		free(pf);
+		return NULL;
+	}
+
+	pf->strm.zalloc = Z_NULL;
+	pf->strm.zfree  = Z_NULL;
+	pf->strm.opaque = Z_NULL;
+	if (deflateInit(&pf->strm, Z_COMP_LEVEL) != Z_OK) {
+		free(pf);
+		return NULL;
+	}
+
+	/* Stream is left unfinished, positioned right before file B */
+	pf->cSize = zlib_deflate(&pf->strm, fin, 0);
+	if (pf->cSize < 0) {
+		(void)deflateEnd(&pf->strm);
+		free(pf);
+		return NULL;
+	}
+	return pf;
+}
+
+
+/**
+ * \brief Return compressed size of A+B cloning the stream primed with A
+ *
+ * \param prefix State returned by zlib_prefix_open()
+ * \param fin Concatenated file (A+B)
+ * \return ssize_t Compressed size
+ */
+ssize_t zlib_prefix_getcompsize(void *prefix, ncd_file_t *fin)
+{
+	zlib_prefix_t *pf = (zlib_prefix_t*)prefix;
+	ssize_t cSize;
+	z_stream strm;
+
+	if (ncd_fseek(fin, fin->fileref[0]->fsize, SEEK_SET) < 0 ||
+			deflateCopy(&strm, &pf->strm) != Z_OK) {
+		ncd_err = -1;
+		return 0;
+	}
+
+	cSize = zlib_deflate(&strm, fin, 1);
+	(void)deflateEnd(&strm);
+
+	if (cSize < 0) {
+		ncd_err = -1;
+		return 0;
+	} else {
+		return pf->cSize + cSize;
+	}
+}
+
+
+/**
+ * \brief Release state returned by zlib_prefix_open()
+ */
+void zlib_prefix_close(void *prefix)
+{
+	zlib_prefix_t *pf = (zlib_prefix_t*)prefix;
+
+	if (pf != NULL) {
+		(void)deflateEnd(&pf->strm);
+		free(pf);
+	}
+}
 #endif
 